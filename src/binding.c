@@ -1,5 +1,4 @@
 #define _GNU_SOURCE
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/input.h>
@@ -7,155 +6,656 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "binding.h"
 #include "buffers.h"
+#include "discovery.h"
 #include "emit.h"
-#include "strings.h"
+#include "keystate.h"
 
-// The input device
-char input_device_name[256] = "Unknown";
-char input_event_path[256] = { '\0' };
-int input_file_descriptor = -1;
+/**
+ * The longest time to wait for the keys of an input device to be released before grabbing it, in milliseconds.
+ * */
+#define GRAB_TIMEOUT 1000
+/**
+ * How often the key state is checked while waiting, in milliseconds.
+ * */
+#define GRAB_POLL_INTERVAL 5
+/**
+ * How long to wait before the grab when the key state is unknown, in milliseconds.
+ * */
+#define GRAB_UNKNOWN_DELAY 200
+
+// The input devices
+struct input_device input_devices[MAX_INPUT_DEVICES];
+int input_device_count = 0;
 
 // The output device
 char output_device_name[32] = "Virtual TouchCursor Keyboard";
 char output_sys_path[256] = { '\0' };
-int output_device_keystate[MAX_KEYBIT];
+unsigned char output_key_references[KEY_CNT];
+// The keys and relative axes enabled on the output device
+static unsigned long output_keys[KEY_BITMAP_SIZE / sizeof(long)];
+static unsigned long output_relatives[REL_BITMAP_SIZE / sizeof(long)];
 int output_file_descriptor = -1;
 
 /**
- * Searches /proc/bus/input/devices for the device event.
- *
- * @param name The device name.
- * @param number The device instance number.
- */
-int find_device_event_path(char* name, int number)
+ * Checks if a bit is set in an ioctl bitmap.
+ * */
+static int test_bit(int bit, const unsigned long* bitmap)
 {
-    log("info: searching for device %s:%i\n", name, number);
-    input_event_path[0] = '\0';
-    FILE* devices_file = fopen("/proc/bus/input/devices", "r");
-    if (!devices_file)
+    return (bitmap[bit / (8 * sizeof(long))] >> (bit % (8 * sizeof(long)))) & 1;
+}
+
+/**
+ * Asks the kernel to stop delivering the event types the output device does not forward,
+ * such as scancodes and LED events, so they no longer wake the event loop.
+ * */
+static void mask_input_events(struct input_device* device)
+{
+    unsigned long types[EV_CNT / (8 * sizeof(long)) + 1] = { 0 };
+    device->scancodes_masked = 0;
+    device->has_leds = 0;
+    if (ioctl(device->file_descriptor, EVIOCGBIT(0, sizeof(types)), types) < 0)
     {
-        error("error: could not open /proc/bus/input/devices\n");
-        return EXIT_FAILURE;
+        warn("warning: failed to get the device event types (EVIOCGBIT: %s)\n", strerror(errno));
+        return;
     }
-    char* line = NULL;
-    int matched_name = 0;
-    int matched_count = 0;
-    int found_event = 0;
-    size_t length = 0;
-    ssize_t result;
-    while (!found_event && (result = getline(&line, &length, devices_file)) != -1)
+    device->has_leds = test_bit(EV_LED, types);
+    // An empty code bitmap masks every code of the type
+    unsigned char none[KEY_CNT / 8] = { 0 };
+    for (int type = EV_SYN + 1; type < EV_CNT; type++)
     {
-        if (length < 3) continue;
-        if (isspace(line[0])) continue;
-        if (!matched_name)
+        if (!test_bit(type, types) || output_supports_event_type(type))
         {
-            if (!starts_with(line, "N: ")) continue;
-            char* trimmed_line = trim_string(line + 3);
-            if (strcmp(trimmed_line, name) == 0)
-            {
-                if (number == ++matched_count)
-                {
-                    matched_name = 1;
-                }
-                continue;
-            }
+            continue;
         }
-        if (matched_name)
+        struct input_mask mask = { type, sizeof(none), (unsigned long)none };
+        if (ioctl(device->file_descriptor, EVIOCSMASK, &mask) < 0)
         {
-            if (!starts_with(line, "H: Handlers")) continue;
-            strcpy(input_device_name, name);
-            char* tokens = line;
-            char* token = strsep(&tokens, "=");
-            while (tokens != NULL)
+            warn("warning: failed to filter input events, they will be dropped after they are read (EVIOCSMASK: %s)\n", strerror(errno));
+            return;
+        }
+        if (type == EV_MSC)
+        {
+            unsigned long codes[MSC_CNT / (8 * sizeof(long)) + 1] = { 0 };
+            if (ioctl(device->file_descriptor, EVIOCGBIT(EV_MSC, sizeof(codes)), codes) >= 0)
             {
-                token = strsep(&tokens, " ");
-                if (starts_with(token, "event"))
-                {
-                    strcat(input_event_path, "/dev/input/");
-                    strcat(input_event_path, token);
-                    log("info: found the device event path: %s\n", input_event_path);
-                    found_event = 1;
-                    break;
-                }
+                device->scancodes_masked = test_bit(MSC_SCAN, codes);
             }
         }
     }
-    fclose(devices_file);
-    if (line) free(line);
-    if (!found_event)
+}
+
+/**
+ * Checks for the device number if it is configured.
+ * Also removes the trailing number configuration from the input.
+ * */
+static int get_device_number(char* device_config_value)
+{
+    int device_number = 1;
+    int length = strlen(device_config_value);
+    for (int i = length - 1; i >= 0; i--)
+    {
+        if (device_config_value[i] == '\0') break;
+        if (device_config_value[i] == '"') break;
+        if (device_config_value[i] == ':')
+        {
+            device_number = atoi(device_config_value + i + 1);
+            device_config_value[i] = '\0';
+        }
+    }
+    return device_number;
+}
+
+/**
+ * Checks if any key of the input device is held, according to the kernel.
+ *
+ * @param keys Receives the key state.
+ * @return int 1 if a key is held, 0 if none is, or -1 on error.
+ * */
+static int read_held_keys(struct input_device* device, unsigned long* keys, size_t size)
+{
+    memset(keys, 0, size);
+    if (ioctl(device->file_descriptor, EVIOCGKEY(size), keys) < 0)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < size / sizeof(long); i++)
+    {
+        if (keys[i] != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Checks the input devices waiting for their keys to be released, while any is waiting
+static void on_grab_timer(struct watcher* watcher, uint32_t events);
+static struct watcher grab_timer_watcher = { -1, on_grab_timer };
+// Called for each input device grabbed by the timer
+static void (*grab_callback)(struct input_device* device) = NULL;
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ * */
+static long monotonic_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Grabs the input device and reads the keys pressed before the grab.
+ * */
+static int grab_input(struct input_device* device)
+{
+    if (ioctl(device->file_descriptor, EVIOCGRAB, 1) < 0)
+    {
+        error("error: failed to capture the device (EVIOCGRAB: %s)\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    device->grabbed = 1;
+    // Keys pressed before the grab are released through the mapper
+    read_input_keys(device);
+    log("info: successfully captured input device: %s (%s)\n", device->name, device->selection.event_path);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Starts the grab timer, unless it is running.
+ * */
+static int start_grab_timer()
+{
+    if (grab_timer_watcher.file_descriptor >= 0)
+    {
+        return EXIT_SUCCESS;
+    }
+    grab_timer_watcher.file_descriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (grab_timer_watcher.file_descriptor < 0)
+    {
+        error("error: failed to create the grab timer: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct itimerspec interval = {
+        .it_interval = { 0, GRAB_POLL_INTERVAL * 1000000L },
+        .it_value = { 0, GRAB_POLL_INTERVAL * 1000000L }
+    };
+    if (timerfd_settime(grab_timer_watcher.file_descriptor, 0, &interval, NULL) < 0
+        || reactor_add(&grab_timer_watcher, EPOLLIN) != EXIT_SUCCESS)
+    {
+        error("error: failed to start the grab timer: %s\n", strerror(errno));
+        close(grab_timer_watcher.file_descriptor);
+        grab_timer_watcher.file_descriptor = -1;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Grabs the input devices whose keys were released or whose wait timed out.
+ * The timer stops once no device is waiting.
+ * */
+static void on_grab_timer(struct watcher* watcher, uint32_t events)
+{
+    (void)events;
+    uint64_t expirations;
+    if (read(watcher->file_descriptor, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        error("error: unable to read the grab timer: %s\n", strerror(errno));
+    }
+    long now = monotonic_time();
+    int waiting = 0;
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        if (device->file_descriptor < 0 || device->grabbed)
+        {
+            continue;
+        }
+        // An unknown key state counts as held until the wait ends
+        int held = read_held_keys(device, device->grab_keys, sizeof(device->grab_keys));
+        if (held != 0 && now < device->grab_deadline)
+        {
+            waiting++;
+            continue;
+        }
+        if (held > 0)
+        {
+            warn("warning: keys are still held after %i ms, capturing anyway\n", GRAB_TIMEOUT);
+        }
+        if (grab_input(device) != EXIT_SUCCESS)
+        {
+            error("error: could not capture the input device\n");
+            release_input(device);
+            continue;
+        }
+        if (grab_callback != NULL)
+        {
+            grab_callback(device);
+        }
+    }
+    if (waiting == 0)
+    {
+        reactor_remove(watcher);
+        close(watcher->file_descriptor);
+        watcher->file_descriptor = -1;
+    }
+}
+
+/**
+ * Searches for the event path of a device selection, from its device line.
+ *
+ * @return int EXIT_SUCCESS if the device was found.
+ * */
+int locate_device(struct device_selection* selection)
+{
+    char name[256];
+    strcpy(name, selection->configuration);
+    int number = get_device_number(name);
+    log("info: searching for device %s:%i\n", name, number);
+    if (discover_device(name, number, selection->event_path) != EXIT_SUCCESS)
     {
         error("error: could not find the event path for device: %s:%i\n", name, number);
         return EXIT_FAILURE;
     }
+    log("info: found the device event path: %s\n", selection->event_path);
     return EXIT_SUCCESS;
 }
 
+/**
+ * Finds the input device that uses a device line.
+ *
+ * @return struct input_device* The device, or NULL if no device uses the line.
+ * */
+struct input_device* find_input_device(const char* configuration)
+{
+    for (int i = 0; i < input_device_count; i++)
+    {
+        if (input_devices[i].selection.configuration[0] != '\0'
+            && strcmp(input_devices[i].selection.configuration, configuration) == 0)
+        {
+            return &input_devices[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Gives an input device a new selection for the same device, keeping its capture and state.
+ * The keymap of the selection stays owned by its configuration.
+ * */
+void update_device_selection(struct input_device* device, struct device_selection* selection)
+{
+    device->selection = *selection;
+    device->mapper.keymap = selection->keymap;
+}
+
+/**
+ * Takes an unused input device for a device selection.
+ *
+ * @return struct input_device* The device, or NULL if every device is used.
+ * */
+struct input_device* adopt_device_selection(struct device_selection* selection)
+{
+    struct input_device* device = NULL;
+    for (int i = 0; i < MAX_INPUT_DEVICES && device == NULL; i++)
+    {
+        if (i == input_device_count || input_devices[i].selection.configuration[0] == '\0')
+        {
+            device = &input_devices[i];
+        }
+    }
+    if (device == NULL)
+    {
+        error("error: too many devices, at most %i can be captured\n", MAX_INPUT_DEVICES);
+        return NULL;
+    }
+    if (device == &input_devices[input_device_count])
+    {
+        input_device_count++;
+    }
+    memset(device, 0, sizeof(*device));
+    device->reader.watcher.file_descriptor = -1;
+    strcpy(device->name, "Unknown");
+    device->file_descriptor = -1;
+    device->clock = CLOCK_REALTIME;
+    initializeMapper(&device->mapper, NULL);
+    update_device_selection(device, selection);
+    return device;
+}
+
+/**
+ * Frees an input device slot. The device must be released.
+ * */
+void drop_input_device(struct input_device* device)
+{
+    memset(&device->selection, 0, sizeof(device->selection));
+    while (input_device_count > 0 && input_devices[input_device_count - 1].selection.configuration[0] == '\0')
+    {
+        input_device_count--;
+    }
+}
+
 /**
  * Binds to the input device using ioctl.
+ * The device is grabbed once its keys are released, see the header.
  * */
-int bind_input()
+int bind_input(struct input_device* device, void (*on_grabbed)(struct input_device* device))
 {
-    if (input_event_path[0] == '\0')
+    if (device->selection.event_path[0] == '\0')
     {
         error("error: no input device was configured (or the event path was not found).\n");
         return EXIT_FAILURE;
     }
     // Open the keyboard device
-    log("info: attempting to cature: '%s'\n", input_event_path);
-    input_file_descriptor = open(input_event_path, O_RDONLY);
-    if (input_file_descriptor < 0)
+    log("info: attempting to cature: '%s'\n", device->selection.event_path);
+    // Read and write, the LEDs of the output device are written to the keyboard
+    int writable = 1;
+    device->file_descriptor = open(device->selection.event_path, O_RDWR | O_CLOEXEC);
+    if (device->file_descriptor < 0)
+    {
+        warn("warning: failed to open the input device for writing, its LEDs will not follow: %s\n", strerror(errno));
+        writable = 0;
+        device->file_descriptor = open(device->selection.event_path, O_RDONLY | O_CLOEXEC);
+    }
+    if (device->file_descriptor < 0)
     {
         error("error: failed to open the input device: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
     // Retrieve the device name
-    if (ioctl(input_file_descriptor, EVIOCGNAME(sizeof(input_device_name)), input_device_name) < 0)
+    if (ioctl(device->file_descriptor, EVIOCGNAME(sizeof(device->name)), device->name) < 0)
     {
         error("error: failed to get the device name (EVIOCGNAME: %s)\n", strerror(errno));
         return EXIT_FAILURE;
     }
     // Check that the device is not our virtual device
-    if (strcasestr(input_device_name, "Virtual TouchCursor Keyboard") != NULL)
+    if (strcasestr(device->name, "Virtual TouchCursor Keyboard") != NULL)
     {
         error("error: you cannot capture the virtual device: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
-    // Allow last key press to go through
-    // Grabbing the keys too quickly prevents the last key up event from being sent
+    // Timestamp events with the monotonic clock, which uinput expects and which does not jump
+    int clock = CLOCK_MONOTONIC;
+    if (ioctl(device->file_descriptor, EVIOCSCLOCKID, &clock) < 0)
+    {
+        warn("warning: failed to set the monotonic clock, timestamps will be replaced (EVIOCSCLOCKID: %s)\n", strerror(errno));
+        device->clock = CLOCK_REALTIME;
+    }
+    else
+    {
+        device->clock = CLOCK_MONOTONIC;
+    }
+    mask_input_events(device);
+    if (!writable)
+    {
+        device->has_leds = 0;
+    }
+    device->led_write_failed = 0;
+    device->grabbed = 0;
+    // A new capture starts at a frame boundary
+    device->buffer_bytes = 0;
+    // Grabbing a device while a key is held keeps its key up event from other applications
     // https://bugs.freedesktop.org/show_bug.cgi?id=101796
-    usleep(200 * 1000);
-    // Grab keys from the input device
-    if (ioctl(input_file_descriptor, EVIOCGRAB, 1) < 0)
+    int held = read_held_keys(device, device->grab_keys, sizeof(device->grab_keys));
+    if (held == 0)
     {
-        error("error: failed to capture the device (EVIOCGRAB: %s)\n", strerror(errno));
-        return EXIT_FAILURE;
+        return grab_input(device);
     }
-    log("info: successfully captured input device: %s (%s)\n", input_device_name, input_event_path);
+    // Allow last key release to go through, the grab timer grabs the device without blocking the event loop
+    if (held < 0)
+    {
+        warn("warning: failed to get the key state, waiting before the grab (EVIOCGKEY: %s)\n", strerror(errno));
+        device->grab_deadline = monotonic_time() + GRAB_UNKNOWN_DELAY * 1000000L;
+    }
+    else
+    {
+        device->grab_deadline = monotonic_time() + GRAB_TIMEOUT * 1000000L;
+    }
+    grab_callback = on_grabbed;
+    if (start_grab_timer() != EXIT_SUCCESS)
+    {
+        // Without the timer the device is grabbed now, rather than never
+        return grab_input(device);
+    }
+    log("info: waiting for the keys of %s to be released before capturing it\n", device->name);
     return EXIT_SUCCESS;
 }
 
+/**
+ * Reads the keys currently held on the input device, to be seeded with seed_input_keys.
+ * */
+void read_input_keys(struct input_device* device)
+{
+    if (read_held_keys(device, device->grab_keys, sizeof(device->grab_keys)) < 0)
+    {
+        memset(device->grab_keys, 0, sizeof(device->grab_keys));
+    }
+}
+
+/**
+ * Runs the keys held on the input device through its mapper.
+ * */
+static void seed_held_keys(struct input_device* device, int press, int mapped)
+{
+    mapper = &device->mapper;
+    // The hyper key first, it decides how the other keys are seeded
+    int hyperKey = configuration->hyperKey;
+    if (hyperKey > 0 && hyperKey < KEY_CNT && test_bit(hyperKey, device->grab_keys))
+    {
+        seedKey(hyperKey, press, mapped);
+    }
+    for (int code = 0; code < KEY_CNT; code++)
+    {
+        if (code != hyperKey && test_bit(code, device->grab_keys))
+        {
+            seedKey(code, press, mapped);
+        }
+    }
+}
+
+/**
+ * Seeds the mapper of the input device with the keys that were held when it was captured.
+ *
+ * @param press Press the held keys on the output device, for keys that were released on it.
+ * */
+void seed_input_keys(struct input_device* device, int press)
+{
+    emit_source(device);
+    // Keys bound to a held hyper key were not mapped when they were pressed, they are left alone
+    seed_held_keys(device, press, 0);
+    emit_flush();
+    emit_source(NULL);
+    memset(device->grab_keys, 0, sizeof(device->grab_keys));
+}
+
+/**
+ * Brings the output keys of a captured input device in line with the keys physically held on it,
+ * as mapped by its current bindings. Only the keys that differ are pressed or released, in one frame.
+ * */
+void reconcile_device_keys(struct input_device* device)
+{
+    if (device->file_descriptor < 0)
+    {
+        return;
+    }
+    read_input_keys(device);
+    reconcile_held_keys(device);
+}
+
+/**
+ * Brings the output keys of an input device in line with the keys in its grab_keys.
+ * */
+void reconcile_held_keys(struct input_device* device)
+{
+    // The keys the held keys map to with the current bindings, from an idle mapper
+    // Keys bound to a held hyper key are mapped, as they were while it was held
+    unsigned char target[KEY_CNT] = { 0 };
+    mapper = &device->mapper;
+    resetMapper();
+    emit_capture(target);
+    seed_held_keys(device, 1, 1);
+    emit_capture(NULL);
+    memset(device->grab_keys, 0, sizeof(device->grab_keys));
+    emit_source(device);
+    int changes = 0;
+    for (int code = 0; code < KEY_CNT; code++)
+    {
+        if (device->held[code] && !target[code])
+        {
+            emit(EV_KEY, code, 0);
+            changes++;
+        }
+    }
+    for (int code = 0; code < KEY_CNT; code++)
+    {
+        if (target[code] && !device->held[code])
+        {
+            emit(EV_KEY, code, 1);
+            changes++;
+        }
+    }
+    emit_flush();
+    emit_source(NULL);
+    if (changes > 0)
+    {
+        log("info: reconciled %i held keys of %s\n", changes, device->name);
+    }
+}
+
 /**
  * Releases the input device.
  * */
-int release_input()
+int release_input(struct input_device* device)
 {
-    if (input_file_descriptor > 0)
+    if (device->file_descriptor > 0)
     {
-        log("info: releasing: %s (%s)\n", input_device_name, input_event_path);
-        ioctl(input_file_descriptor, EVIOCGRAB, 0);
-        close(input_file_descriptor);
+        log("info: releasing: %s (%s)\n", device->name, device->selection.event_path);
+        if (device->grabbed)
+        {
+            ioctl(device->file_descriptor, EVIOCGRAB, 0);
+        }
+        close(device->file_descriptor);
+        device->file_descriptor = -1;
+        device->grabbed = 0;
     }
     return EXIT_SUCCESS;
 }
 
 /**
- * Creates and binds a virtual output device using ioctl and uinput.
+ * Checks if the output device forwards an event type.
+ * Events of other types are filtered from the input device.
  * */
-int bind_output()
+int output_supports_event_type(int type)
+{
+    return type == EV_SYN || type == EV_KEY || type == EV_REL;
+}
+
+/**
+ * Sets a bit in an ioctl bitmap.
+ * */
+static void set_bit(int bit, unsigned long* bitmap)
+{
+    bitmap[bit / (8 * sizeof(long))] |= 1UL << (bit % (8 * sizeof(long)));
+}
+
+/**
+ * Adds the keys a keymap emits to a key bitmap.
+ * */
+static void add_binding_keys(const struct key_output* bindings, unsigned long* keys)
+{
+    for (int code = 0; code < 256; code++)
+    {
+        for (int i = 0; i < MAX_SEQUENCE && bindings[code].sequence[i] != 0; i++)
+        {
+            if (bindings[code].sequence[i] > 0 && bindings[code].sequence[i] < KEY_CNT)
+            {
+                set_bit(bindings[code].sequence[i], keys);
+            }
+        }
+    }
+}
+
+/**
+ * Collects the capabilities the output device needs: the keys and relative axes
+ * of the captured input devices, and the keys the bindings emit.
+ * Every key up to MAX_KEYBIT is enabled if no input device is captured yet.
+ * */
+static void collect_output_capabilities(unsigned long* keys, unsigned long* relatives)
+{
+    memset(keys, 0, KEY_BITMAP_SIZE);
+    memset(relatives, 0, REL_BITMAP_SIZE);
+    int captured = 0;
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        if (device->file_descriptor < 0)
+        {
+            continue;
+        }
+        unsigned long device_keys[KEY_BITMAP_SIZE / sizeof(long)] = { 0 };
+        unsigned long device_relatives[REL_BITMAP_SIZE / sizeof(long)] = { 0 };
+        if (ioctl(device->file_descriptor, EVIOCGBIT(EV_KEY, sizeof(device_keys)), device_keys) < 0)
+        {
+            warn("warning: failed to get the device keys (EVIOCGBIT: %s)\n", strerror(errno));
+            continue;
+        }
+        if (ioctl(device->file_descriptor, EVIOCGBIT(EV_REL, sizeof(device_relatives)), device_relatives) < 0)
+        {
+            memset(device_relatives, 0, sizeof(device_relatives));
+        }
+        for (size_t j = 0; j < KEY_BITMAP_SIZE / sizeof(long); j++)
+        {
+            keys[j] |= device_keys[j];
+        }
+        for (size_t j = 0; j < REL_BITMAP_SIZE / sizeof(long); j++)
+        {
+            relatives[j] |= device_relatives[j];
+        }
+        captured = 1;
+    }
+    if (!captured)
+    {
+        for (int code = 0; code <= MAX_KEYBIT; code++)
+        {
+            set_bit(code, keys);
+        }
+    }
+    add_binding_keys(configuration->keymap, keys);
+    for (int i = 0; i < input_device_count; i++)
+    {
+        if (input_devices[i].selection.keymap != NULL)
+        {
+            add_binding_keys(input_devices[i].selection.keymap, keys);
+        }
+    }
+    for (int code = 0; code < 256; code++)
+    {
+        if (configuration->remap[code] > 0 && configuration->remap[code] < KEY_CNT)
+        {
+            set_bit(configuration->remap[code], keys);
+        }
+    }
+    if (configuration->hyperKey > 0 && configuration->hyperKey < KEY_CNT)
+    {
+        set_bit(configuration->hyperKey, keys);
+    }
+}
+
+/**
+ * Creates the virtual output device with a set of keys and relative axes.
+ *
+ * @param quiet Do not report failures, used while probing.
+ * @return int The uinput file descriptor, or -1 on failure.
+ * */
+static int create_output(const unsigned long* keys, const unsigned long* relatives, int quiet)
 {
     // Define the virtual keyboard
     struct uinput_setup virtual_keyboard;
@@ -166,65 +666,348 @@ int bind_output()
     virtual_keyboard.id.product = 0x01;
     virtual_keyboard.id.version = 1;
     // Open uinput
-    output_file_descriptor = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if (output_file_descriptor < 0)
+    // Read and write, the LED changes sent to the device are read back
+    int file_descriptor = open("/dev/uinput", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (file_descriptor < 0)
     {
         error("error: failed to open /dev/uinput: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        return -1;
     }
     // Enable key press/release events
-    if (ioctl(output_file_descriptor, UI_SET_EVBIT, EV_KEY) < 0)
+    if (ioctl(file_descriptor, UI_SET_EVBIT, EV_KEY) < 0)
     {
-        error("error: failed to set EV_KEY on output (UI_SET_KEYBIT, EV_KEY: %s)\n", strerror(errno));
-        return EXIT_FAILURE;
+        error("error: failed to set EV_KEY on output (UI_SET_EVBIT, EV_KEY: %s)\n", strerror(errno));
+        close(file_descriptor);
+        return -1;
     }
     // Enable the set of KEY events
-    for (int i = 0; i <= MAX_KEYBIT; i++)
+    int key_count = 0;
+    for (int code = 0; code < KEY_CNT; code++)
     {
-        int result = ioctl(output_file_descriptor, UI_SET_KEYBIT, i);
-        if (result < 0)
+        if (!test_bit(code, keys))
         {
-            error("error: failed to set key bit (UI_SET_KEYBIT, %i: %s)\n", i, strerror(errno));
-            return EXIT_FAILURE;
+            continue;
         }
+        if (ioctl(file_descriptor, UI_SET_KEYBIT, code) < 0)
+        {
+            error("error: failed to set key bit (UI_SET_KEYBIT, %i: %s)\n", code, strerror(errno));
+            close(file_descriptor);
+            return -1;
+        }
+        key_count++;
+    }
+    // Enable the keyboard LEDs, so the LED changes sent to the device can be forwarded
+    if (ioctl(file_descriptor, UI_SET_EVBIT, EV_LED) < 0)
+    {
+        error("error: failed to set EV_LED on output (UI_SET_EVBIT, EV_LED: %s)\n", strerror(errno));
+        close(file_descriptor);
+        return -1;
+    }
+    for (int code = LED_NUML; code <= LED_KANA; code++)
+    {
+        if (ioctl(file_descriptor, UI_SET_LEDBIT, code) < 0)
+        {
+            error("error: failed to set LED bit (UI_SET_LEDBIT, %i: %s)\n", code, strerror(errno));
+            close(file_descriptor);
+            return -1;
+        }
+    }
+    // Enable the relative axes, for pointing sticks on keyboards
+    int relative_count = 0;
+    for (int code = 0; code < REL_CNT; code++)
+    {
+        if (!test_bit(code, relatives))
+        {
+            continue;
+        }
+        if ((relative_count == 0 && ioctl(file_descriptor, UI_SET_EVBIT, EV_REL) < 0)
+            || ioctl(file_descriptor, UI_SET_RELBIT, code) < 0)
+        {
+            error("error: failed to set relative bit (UI_SET_RELBIT, %i: %s)\n", code, strerror(errno));
+            close(file_descriptor);
+            return -1;
+        }
+        relative_count++;
     }
     // Set up the device
-    if (ioctl(output_file_descriptor, UI_DEV_SETUP, &virtual_keyboard) < 0)
+    if (ioctl(file_descriptor, UI_DEV_SETUP, &virtual_keyboard) < 0)
     {
         error("error: failed to set up the virtual device (UI_DEV_SETUP: %s)\n", strerror(errno));
-        return EXIT_FAILURE;
+        close(file_descriptor);
+        return -1;
     }
     // Create the device
-    if (ioctl(output_file_descriptor, UI_DEV_CREATE) < 0)
+    if (ioctl(file_descriptor, UI_DEV_CREATE) < 0)
     {
-        error("error: failed to create the virtual device (UI_DEV_CREATE: %s)\n", strerror(errno));
-        return EXIT_FAILURE;
+        if (!quiet)
+        {
+            error("error: failed to create the virtual device with %i keys (UI_DEV_CREATE: %s)\n", key_count, strerror(errno));
+        }
+        close(file_descriptor);
+        return -1;
     }
-    // Get the device path
+    if (!quiet)
+    {
+        log("info: enabled %i keys and %i relative axes on the output device\n", key_count, relative_count);
+    }
+    return file_descriptor;
+}
+
+/**
+ * Reads the sysfs path of the output device.
+ * */
+static int read_output_sys_path()
+{
     char sysname[16];
     if (ioctl(output_file_descriptor, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
     {
         error("error: failed to get the sysfs name (UI_GET_SYSNAME: %s)\n", strerror(errno));
         return EXIT_FAILURE;
     }
-    strcat(output_sys_path, "/sys/devices/virtual/input/");
+    strcpy(output_sys_path, "/sys/devices/virtual/input/");
     strcat(output_sys_path, sysname);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Creates and binds a virtual output device using ioctl and uinput.
+ * The device mirrors the keys and relative axes of the captured input devices.
+ * */
+int bind_output()
+{
+    collect_output_capabilities(output_keys, output_relatives);
+    output_file_descriptor = create_output(output_keys, output_relatives, 0);
+    int clipped = 0;
+    for (int code = MAX_KEYBIT + 1; code < KEY_CNT; code++)
+    {
+        clipped |= test_bit(code, output_keys);
+    }
+    if (output_file_descriptor < 0 && clipped)
+    {
+        // The kernel rejects devices with too many keys, see MAX_KEYBIT
+        warn("warning: retrying without the keys above %i\n", MAX_KEYBIT);
+        for (int code = MAX_KEYBIT + 1; code < KEY_CNT; code++)
+        {
+            output_keys[code / (8 * sizeof(long))] &= ~(1UL << (code % (8 * sizeof(long))));
+        }
+        output_file_descriptor = create_output(output_keys, output_relatives, 0);
+    }
+    if (output_file_descriptor < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (read_output_sys_path() != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
     log("info: successfully created output device: %s (%s)\n", output_device_name, output_sys_path);
     return EXIT_SUCCESS;
 }
 
+/**
+ * Copies the keys and relative axes enabled on the output device.
+ * */
+void get_output_capabilities(unsigned long* keys, unsigned long* relatives)
+{
+    memcpy(keys, output_keys, sizeof(output_keys));
+    memcpy(relatives, output_relatives, sizeof(output_relatives));
+}
+
+/**
+ * Takes over an output device created by a previous process, with the keys and relative axes it enabled.
+ * */
+int resume_output(int file_descriptor, const unsigned long* keys, const unsigned long* relatives)
+{
+    output_file_descriptor = file_descriptor;
+    memcpy(output_keys, keys, sizeof(output_keys));
+    memcpy(output_relatives, relatives, sizeof(output_relatives));
+    if (read_output_sys_path() != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    log("info: resumed output device: %s (%s)\n", output_device_name, output_sys_path);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Checks if the output device lacks capabilities the captured input devices or the bindings need.
+ * */
+int output_capabilities_changed()
+{
+    unsigned long keys[KEY_BITMAP_SIZE / sizeof(long)];
+    unsigned long relatives[REL_BITMAP_SIZE / sizeof(long)];
+    collect_output_capabilities(keys, relatives);
+    for (size_t i = 0; i < KEY_BITMAP_SIZE / sizeof(long); i++)
+    {
+        if (keys[i] & ~output_keys[i])
+        {
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < REL_BITMAP_SIZE / sizeof(long); i++)
+    {
+        if (relatives[i] & ~output_relatives[i])
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Finds the highest key code the virtual device can be created with, enabling every key up to it.
+ * This is the limit behind MAX_KEYBIT: the kernel lists every key in the modalias of the
+ * device uevent, and creating the device fails once that no longer fits.
+ * */
+int probe_keybits()
+{
+    unsigned long keys[KEY_BITMAP_SIZE / sizeof(long)];
+    unsigned long relatives[REL_BITMAP_SIZE / sizeof(long)] = { 0 };
+    if (access("/dev/uinput", W_OK) < 0)
+    {
+        error("error: cannot write to /dev/uinput: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int lowest = 0;
+    int highest = KEY_MAX;
+    int found = -1;
+    while (lowest <= highest)
+    {
+        int middle = (lowest + highest) / 2;
+        memset(keys, 0, sizeof(keys));
+        for (int code = 0; code <= middle; code++)
+        {
+            set_bit(code, keys);
+        }
+        int file_descriptor = create_output(keys, relatives, 1);
+        if (file_descriptor >= 0)
+        {
+            ioctl(file_descriptor, UI_DEV_DESTROY);
+            close(file_descriptor);
+            found = middle;
+            lowest = middle + 1;
+        }
+        else
+        {
+            highest = middle - 1;
+        }
+        log("info: keys 0-%i: %s\n", middle, file_descriptor >= 0 ? "created" : "failed");
+    }
+    if (found < 0)
+    {
+        error("error: the virtual device could not be created\n");
+        return EXIT_FAILURE;
+    }
+    log("info: the virtual device can be created with every key up to %i (MAX_KEYBIT is %i)\n", found, MAX_KEYBIT);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Forgets which input devices hold keys on the output device.
+ * Called once every key was released.
+ * */
+void clear_output_key_references()
+{
+    memset(output_key_references, 0, sizeof(output_key_references));
+    for (int i = 0; i < input_device_count; i++)
+    {
+        memset(input_devices[i].held, 0, sizeof(input_devices[i].held));
+    }
+}
+
+/**
+ * Releases the keys an input device holds on the output device,
+ * unless another input device holds them too.
+ * */
+void release_device_keys(struct input_device* device)
+{
+    emit_source(device);
+    for (int code = 0; code < KEY_CNT; code++)
+    {
+        if (device->held[code])
+        {
+            emit(EV_KEY, code, 0);
+        }
+    }
+    emit_flush();
+    emit_source(NULL);
+}
+
 /**
  * Releases any held keys on the output device.
  * */
 void release_output_keys()
 {
-    for (int i = 0; i < MAX_KEYBIT; i++)
+    emit_source(NULL);
+    for (int code = keystate_next(0); code >= 0; code = keystate_next(code + 1))
     {
-        if (output_device_keystate[i] > 0)
+        /* log("info: releasing key: %i\n", code); */
+        emit(EV_KEY, code, 0);
+    }
+    emit_flush();
+    keystate_clear();
+    clear_output_key_references();
+}
+
+/**
+ * Reads the events sent to the output device and forwards its LED changes to the captured input devices.
+ * The changes read at once are written to each input device as one frame.
+ * */
+void forward_output_leds()
+{
+    struct input_event events[16];
+    int leds[LED_CNT];
+    int changed = 0;
+    for (int code = 0; code < LED_CNT; code++)
+    {
+        leds[code] = -1;
+    }
+    ssize_t result;
+    while ((result = read(output_file_descriptor, events, sizeof(events))) > 0)
+    {
+        for (size_t i = 0; i < result / sizeof(struct input_event); i++)
+        {
+            // Only the last state of each LED matters
+            if (events[i].type == EV_LED && events[i].code < LED_CNT)
+            {
+                changed += leds[events[i].code] < 0;
+                leds[events[i].code] = events[i].value != 0;
+            }
+        }
+    }
+    if (result < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        error("error: unable to read output device events: %s\n", strerror(errno));
+    }
+    if (changed == 0)
+    {
+        return;
+    }
+    struct input_event frame[LED_CNT + 1];
+    int length = 0;
+    for (int code = 0; code < LED_CNT; code++)
+    {
+        if (leds[code] >= 0)
+        {
+            frame[length++] = (struct input_event){ .type = EV_LED, .code = code, .value = leds[code] };
+        }
+    }
+    frame[length++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        if (device->file_descriptor < 0 || !device->has_leds)
+        {
+            continue;
+        }
+        if (write(device->file_descriptor, frame, length * sizeof(struct input_event)) < 0 && errno != ENODEV)
         {
-            /* log("info: releasing key: %i\n", i); */
-            emit(EV_KEY, i, 0);
-            output_device_keystate[i] = 0;
+            // Reported once per capture, the LEDs change often
+            if (!device->led_write_failed)
+            {
+                warn("warning: failed to set the LEDs of %s: %s\n", device->name, strerror(errno));
+            }
+            device->led_write_failed = 1;
         }
     }
 }
@@ -239,6 +1022,7 @@ int release_output()
         log("info: releasing: %s (%s)\n", output_device_name, output_sys_path);
         ioctl(output_file_descriptor, UI_DEV_DESTROY);
         close(output_file_descriptor);
+        output_file_descriptor = -1;
     }
     return EXIT_SUCCESS;
 }
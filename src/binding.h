@@ -1,6 +1,12 @@
 #ifndef binding_h
 #define binding_h
 
+#include <linux/input.h>
+#include <stddef.h>
+
+#include "engine.h"
+#include "mapper.h"
+
 /**
  * @brief The upper limit for enabling key events.
  *
@@ -10,39 +16,173 @@
  * from KEY_MAX until things started working again. Not sure what the underlying
  * cause is. For further reference, see
  * https://github.com/donniebreve/touchcursor-linux/pull/39#issuecomment-1000901050.
+ *
+ * The output device now mirrors the keys of the captured devices, this is the fallback
+ * when no device is captured yet or the mirrored set is rejected. Run with --probe-keybits
+ * to find the limit of the running kernel.
  */
 #define MAX_KEYBIT 572
 
 /**
- * The name of the input device.
+ * The size of an ioctl bitmap for a number of codes, in bytes.
+ * */
+#define BITMAP_SIZE(count) (((count) + 8 * sizeof(long) - 1) / (8 * sizeof(long)) * sizeof(long))
+#define KEY_BITMAP_SIZE BITMAP_SIZE(KEY_CNT)
+#define REL_BITMAP_SIZE BITMAP_SIZE(REL_CNT)
+
+/**
+ * The number of input events read per syscall.
+ * */
+#define INPUT_BUFFER_EVENTS 64
+
+/**
+ * A captured input device.
  * */
-extern char input_device_name[256];
+struct input_device
+{
+    /**
+     * The reader for the device. Must be the first member.
+     * */
+    struct reader reader;
+    /**
+     * The device selection the device was captured for, with its event path and bindings.
+     * */
+    struct device_selection selection;
+    /**
+     * The name of the input device.
+     * */
+    char name[256];
+    /**
+     * The file descriptor for the input device.
+     * */
+    int file_descriptor;
+    /**
+     * The clock used for the input event timestamps.
+     * */
+    int clock;
+    /**
+     * Set if the kernel filters the scancode (MSC_SCAN) events the input device reports.
+     * */
+    int scancodes_masked;
+    /**
+     * Set if the input device has LEDs, they follow the LEDs of the output device.
+     * */
+    int has_leds;
+    /**
+     * Set once writing the LEDs to the input device failed, so the failure is reported once.
+     * */
+    int led_write_failed;
+    /**
+     * Set once the input device is grabbed. A device waiting for its keys to be released is open but not grabbed.
+     * */
+    int grabbed;
+    /**
+     * When a device waiting for its keys to be released is grabbed anyway, in monotonic nanoseconds.
+     * */
+    long grab_deadline;
+    /**
+     * The keys that were held when the device was captured.
+     * */
+    unsigned long grab_keys[KEY_CNT / (8 * sizeof(long)) + 1];
+    /**
+     * Set by the reader when the device disconnected.
+     * */
+    int disconnected;
+    /**
+     * When the device was captured again after it disconnected, in monotonic nanoseconds,
+     * until its first key frame is processed.
+     * */
+    long reconnected;
+    /**
+     * The input event buffer, which can hold a partial frame between reads.
+     * */
+    struct input_event buffer[INPUT_BUFFER_EVENTS];
+    size_t buffer_bytes;
+    /**
+     * The mapper state for the device.
+     * */
+    struct mapper_state mapper;
+    /**
+     * The keys this device holds down on the output device.
+     * */
+    unsigned char held[KEY_CNT];
+};
+
 /**
- * The event path for the input device.
+ * The input devices. A device keeps its slot while it is captured, unused slots have an empty selection.
  * */
-extern char input_event_path[256];
+extern struct input_device input_devices[MAX_INPUT_DEVICES];
+extern int input_device_count;
+
 /**
- * The file descriptor for the input device.
+ * Searches for the event path of a device selection, from its device line.
+ *
+ * @return int EXIT_SUCCESS if the device was found.
  * */
-extern int input_file_descriptor;
+int locate_device(struct device_selection* selection);
 
 /**
- * Searches /proc/bus/input/devices for the device event.
+ * Finds the input device that uses a device line.
  *
- * @param name The device name.
- * @param number The device instance number.
- */
-int find_device_event_path(char* name, int number);
+ * @return struct input_device* The device, or NULL if no device uses the line.
+ * */
+struct input_device* find_input_device(const char* configuration);
+
+/**
+ * Takes an unused input device for a device selection.
+ *
+ * @return struct input_device* The device, or NULL if every device is used.
+ * */
+struct input_device* adopt_device_selection(struct device_selection* selection);
+
+/**
+ * Gives an input device a new selection for the same device, keeping its capture and state.
+ * The keymap of the selection stays owned by its configuration.
+ * */
+void update_device_selection(struct input_device* device, struct device_selection* selection);
+
+/**
+ * Frees an input device slot. The device must be released.
+ * */
+void drop_input_device(struct input_device* device);
+
+/**
+ * Reads the keys currently held on the input device, to be seeded with seed_input_keys.
+ * */
+void read_input_keys(struct input_device* device);
 
 /**
  * Binds to the input device using ioctl.
+ * A device with keys held is grabbed by a reactor timer once they are released or after a timeout,
+ * then on_grabbed is called for it from the event loop. Otherwise it is grabbed before this returns.
+ *
+ * @return int EXIT_SUCCESS if the device is grabbed or waiting to be grabbed.
+ * */
+int bind_input(struct input_device* device, void (*on_grabbed)(struct input_device* device));
+
+/**
+ * Seeds the mapper of the input device with the keys that were held when it was captured.
+ *
+ * @param press Press the held keys on the output device, for keys that were released on it.
  * */
-int bind_input();
+void seed_input_keys(struct input_device* device, int press);
+
+/**
+ * Brings the output keys of a captured input device in line with the keys physically held on it,
+ * as mapped by its current bindings. Only the keys that differ are pressed or released, in one frame.
+ * */
+void reconcile_device_keys(struct input_device* device);
+
+/**
+ * Brings the output keys of an input device in line with the keys in its grab_keys, as reconcile_device_keys
+ * does after reading them from the device.
+ * */
+void reconcile_held_keys(struct input_device* device);
 
 /**
  * Releases the input device.
  * */
-int release_input();
+int release_input(struct input_device* device);
 
 /**
  * The name of the output device.
@@ -53,24 +193,74 @@ extern char output_device_name[32];
  * */
 extern char output_sys_path[256];
 /**
- * The output device key state.
+ * The number of input devices holding each key on the output device.
  * */
-extern int output_device_keystate[MAX_KEYBIT];
+extern unsigned char output_key_references[KEY_CNT];
 /**
  * The file descriptor for the output device.
  * */
 extern int output_file_descriptor;
 
+/**
+ * Checks if the output device forwards an event type.
+ * Events of other types are filtered from the input device.
+ * */
+int output_supports_event_type(int type);
+
 /**
  * Creates and binds a virtual output device using ioctl and uinput.
+ * The device mirrors the keys and relative axes of the captured input devices.
  * */
 int bind_output();
 
+/**
+ * Checks if the output device lacks capabilities the captured input devices or the bindings need.
+ * */
+int output_capabilities_changed();
+
+/**
+ * Finds the highest key code the virtual device can be created with, enabling every key up to it.
+ * This is the limit behind MAX_KEYBIT: the kernel lists every key in the modalias of the
+ * device uevent, and creating the device fails once that no longer fits.
+ * */
+int probe_keybits();
+
+/**
+ * Forgets which input devices hold keys on the output device.
+ * Called once every key was released.
+ * */
+void clear_output_key_references();
+
+/**
+ * Releases the keys an input device holds on the output device,
+ * unless another input device holds them too.
+ * */
+void release_device_keys(struct input_device* device);
+
 /**
  * Releases any held keys on the output device.
  * */
 void release_output_keys();
 
+/**
+ * Copies the keys and relative axes enabled on the output device.
+ *
+ * @param keys A bitmap of KEY_BITMAP_SIZE bytes.
+ * @param relatives A bitmap of REL_BITMAP_SIZE bytes.
+ * */
+void get_output_capabilities(unsigned long* keys, unsigned long* relatives);
+
+/**
+ * Takes over an output device created by a previous process, with the keys and relative axes it enabled.
+ * */
+int resume_output(int file_descriptor, const unsigned long* keys, const unsigned long* relatives);
+
+/**
+ * Reads the events sent to the output device and forwards its LED changes to the captured input devices.
+ * The changes read at once are written to each input device as one frame.
+ * */
+void forward_output_leds();
+
 /**
  * Releases the virtual output device.
  * */
@@ -1,42 +1,73 @@
 #define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include "binding.h"
 #include "buffers.h"
 #include "config.h"
 #include "keys.h"
+#include "reactor.h"
 #include "strings.h"
 
 char configuration_file_path[256];
 
-int hyperKey;
-struct key_output keymap[256] = { 0 };
-int remap[256] = { 0 };
+/**
+ * The configuration until one is loaded, and for the tests.
+ * */
+static struct configuration default_configuration = { .output_timestamp = timestamp_input, .performance_engine = engine_syscall };
+struct configuration* configuration = &default_configuration;
+
+/**
+ * The configuration loaded by the loader thread, until the event loop takes it.
+ * */
+static struct configuration* loaded_configuration = NULL;
+static struct watcher loader_watcher = { -1, NULL };
+static pthread_t loader_thread;
+static void (*loader_callback)(struct configuration* loaded) = NULL;
 
 /**
- * Checks for the device number if it is configured.
- * Also removes the trailing number configuration from the input.
+ * Parses a boolean configuration value.
+ * Accepts true/false, yes/no, on/off and 1/0.
  * */
-static int get_device_number(char* device_config_value)
+static int parse_boolean(char* value, int* result)
 {
-    int device_number = 1;
-    int length = strlen(device_config_value);
-    for (int i = length - 1; i >= 0; i--)
+    if (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0
+        || strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0)
     {
-        if (device_config_value[i] == '\0') break;
-        if (device_config_value[i] == '"') break;
-        if (device_config_value[i] == ':')
-        {
-            device_number = atoi(device_config_value + i + 1);
-            device_config_value[i] = '\0';
-        }
+        *result = 1;
+        return EXIT_SUCCESS;
+    }
+    if (strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0
+        || strcasecmp(value, "off") == 0 || strcmp(value, "0") == 0)
+    {
+        *result = 0;
+        return EXIT_SUCCESS;
     }
-    return device_number;
+    return EXIT_FAILURE;
+}
+
+/**
+ * Parses an integer configuration value within a range.
+ * */
+static int parse_integer(char* value, int minimum, int maximum, int* result)
+{
+    char* end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < minimum || number > maximum)
+    {
+        return EXIT_FAILURE;
+    }
+    *result = (int)number;
+    return EXIT_SUCCESS;
 }
 
 /**
@@ -83,32 +114,161 @@ int find_configuration_file()
     return EXIT_FAILURE;
 }
 
-static enum sections {
+/**
+ * Builds the output frames for every binding of a keymap.
+ * */
+static void compile_keymap(struct configuration* loaded, struct key_output* bindings)
+{
+    for (int code = 0; code < 256; code++)
+    {
+        struct key_output* output = &bindings[code];
+        output->frame_length = 0;
+        if (output->sequence[0] == 0)
+        {
+            continue;
+        }
+        for (int value = 0; value < 3; value++)
+        {
+            struct input_event* frame = output->frames[value];
+            int length = 0;
+            for (int i = 0; i < MAX_SEQUENCE && output->sequence[i] != 0; i++)
+            {
+                frame[length++] = (struct input_event){ .type = EV_KEY, .code = output->sequence[i], .value = value };
+                if (loaded->output_frame_per_key)
+                {
+                    frame[length++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+                }
+            }
+            if (!loaded->output_frame_per_key)
+            {
+                frame[length++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+            }
+            output->frame_length = length;
+        }
+    }
+}
+
+/**
+ * Builds the output frames for every binding of a configuration, and the key actions.
+ * Called after the bindings, remaps, hyper key or output settings change.
+ * */
+void compile_bindings(struct configuration* loaded)
+{
+    for (int code = 0; code < KEY_CNT; code++)
+    {
+        if (code == loaded->hyperKey)
+        {
+            loaded->key_actions[code] = key_action_hyper;
+        }
+        else if (code < 256 && loaded->remap[code] != 0)
+        {
+            loaded->key_actions[code] = key_action_remap;
+        }
+        else
+        {
+            loaded->key_actions[code] = key_action_pass;
+        }
+    }
+    compile_keymap(loaded, loaded->keymap);
+    for (int i = 0; i < loaded->device_selection_count; i++)
+    {
+        if (loaded->device_selections[i].keymap != NULL)
+        {
+            compile_keymap(loaded, loaded->device_selections[i].keymap);
+        }
+    }
+}
+
+/**
+ * Completes the per-device bindings with the global bindings they do not override.
+ * */
+static void merge_device_bindings(struct configuration* loaded)
+{
+    for (int i = 0; i < loaded->device_selection_count; i++)
+    {
+        struct key_output* bindings = loaded->device_selections[i].keymap;
+        if (bindings == NULL)
+        {
+            continue;
+        }
+        for (int code = 0; code < 256; code++)
+        {
+            if (bindings[code].sequence[0] == 0)
+            {
+                bindings[code] = loaded->keymap[code];
+            }
+        }
+    }
+}
+
+/**
+ * Adds a device selection, for a [Device] section.
+ * */
+static struct device_selection* add_device_selection(struct configuration* loaded)
+{
+    if (loaded->device_selection_count >= MAX_INPUT_DEVICES)
+    {
+        error("error: too many devices, at most %i can be captured\n", MAX_INPUT_DEVICES);
+        return NULL;
+    }
+    struct device_selection* selection = &loaded->device_selections[loaded->device_selection_count++];
+    memset(selection, 0, sizeof(*selection));
+    return selection;
+}
+
+/**
+ * Finds the device selection of a device line.
+ * */
+static struct device_selection* find_device_selection(struct configuration* loaded, const char* device_line)
+{
+    for (int i = 0; i < loaded->device_selection_count; i++)
+    {
+        if (strcmp(loaded->device_selections[i].configuration, device_line) == 0)
+        {
+            return &loaded->device_selections[i];
+        }
+    }
+    return NULL;
+}
+
+enum sections {
     configuration_none,
     configuration_device,
     configuration_remap,
     configuration_hyper,
     configuration_bindings,
+    configuration_output,
+    configuration_performance,
     configuration_invalid
-} section;
+};
 
 /**
- * Reads the configuration file.
+ * Reads and compiles the configuration file into a new configuration.
+ * Safe to call from any thread.
  * */
-int read_configuration()
+struct configuration* load_configuration()
 {
-    // Zero the existing arrays
-    memset(keymap, 0, sizeof(keymap));
-    memset(remap, 0, sizeof(remap));
+    struct configuration* loaded = calloc(1, sizeof(struct configuration));
+    if (loaded == NULL)
+    {
+        error("error: failed to allocate the configuration\n");
+        return NULL;
+    }
+    loaded->output_timestamp = timestamp_input;
+    loaded->performance_engine = engine_syscall;
 
     // Open the configuration file
     FILE* configuration_file = fopen(configuration_file_path, "r");
     if (!configuration_file)
     {
         error("error: could not open the configuration file\n");
-        return EXIT_FAILURE;
+        free(loaded);
+        return NULL;
     }
     // Parse the configuration file
+    struct device_selection* device = NULL;
+    struct key_output* bindings = loaded->keymap;
+    enum sections section = configuration_none;
     char* buffer = NULL;
     size_t length = 0;
     ssize_t result = -1;
@@ -127,7 +287,8 @@ int read_configuration()
             size_t line_length = strlen(line);
             if (strncmp(line, "[Device]", line_length) == 0)
             {
-                section = configuration_device;
+                device = add_device_selection(loaded);
+                section = device != NULL ? configuration_device : configuration_invalid;
                 continue;
             }
             if (strncmp(line, "[Remap]", line_length) == 0)
@@ -142,9 +303,45 @@ int read_configuration()
             }
             if (strncmp(line, "[Bindings]", line_length) == 0)
             {
+                bindings = loaded->keymap;
                 section = configuration_bindings;
                 continue;
             }
+            if (starts_with(line, "[Bindings:") && line[line_length - 1] == ']')
+            {
+                // Bindings for one device, named by its device line
+                line[line_length - 1] = '\0';
+                struct device_selection* bound_device = find_device_selection(loaded, line + strlen("[Bindings:"));
+                if (bound_device == NULL)
+                {
+                    error("error: no device is configured for section: %s]\n", line);
+                    section = configuration_invalid;
+                    continue;
+                }
+                if (bound_device->keymap == NULL)
+                {
+                    bound_device->keymap = calloc(256, sizeof(struct key_output));
+                    if (bound_device->keymap == NULL)
+                    {
+                        error("error: failed to allocate the device bindings\n");
+                        section = configuration_invalid;
+                        continue;
+                    }
+                }
+                bindings = bound_device->keymap;
+                section = configuration_bindings;
+                continue;
+            }
+            if (strncmp(line, "[Output]", line_length) == 0)
+            {
+                section = configuration_output;
+                continue;
+            }
+            if (strncmp(line, "[Performance]", line_length) == 0)
+            {
+                section = configuration_performance;
+                continue;
+            }
             error("error: invalid section: %s\n", line);
             section = configuration_invalid;
             continue;
@@ -154,12 +351,18 @@ int read_configuration()
         {
             case configuration_device:
             {
-                char* name = line;
-                int number = get_device_number(name);
-                if (find_device_event_path(name, number) == EXIT_SUCCESS)
+                // The first line that is found is used, the first line names the device until then
+                char first[256];
+                strcpy(first, device->configuration);
+                snprintf(device->configuration, sizeof(device->configuration), "%s", line);
+                if (locate_device(device) == EXIT_SUCCESS)
                 {
                     section = configuration_none;
                 }
+                else if (first[0] != '\0')
+                {
+                    strcpy(device->configuration, first);
+                }
                 break;
             }
             case configuration_remap:
@@ -169,7 +372,7 @@ int read_configuration()
                 int fromCode = convertKeyStringToCode(token);
                 token = strsep(&tokens, "=");
                 int toCode = convertKeyStringToCode(token);
-                remap[fromCode] = toCode;
+                loaded->remap[fromCode] = toCode;
                 break;
             }
             case configuration_hyper:
@@ -178,7 +381,7 @@ int read_configuration()
                 char* token = strsep(&tokens, "=");
                 token = strsep(&tokens, "=");
                 int code = convertKeyStringToCode(token);
-                hyperKey = code;
+                loaded->hyperKey = code;
                 break;
             }
             case configuration_bindings:
@@ -190,7 +393,116 @@ int read_configuration()
                 while ((token = strsep(&tokens, ",")) != NULL && index < MAX_SEQUENCE)
                 {
                     int toCode = convertKeyStringToCode(token);
-                    keymap[fromCode].sequence[index++] = toCode;
+                    bindings[fromCode].sequence[index++] = toCode;
+                }
+                break;
+            }
+            case configuration_output:
+            {
+                char* tokens = line;
+                char* key = trim_string(strsep(&tokens, "="));
+                char* value = tokens ? trim_string(tokens) : "";
+                if (strcmp(key, "FramePerKey") == 0)
+                {
+                    if (parse_boolean(value, &loaded->output_frame_per_key) != EXIT_SUCCESS)
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else if (strcmp(key, "Timestamp") == 0)
+                {
+                    if (strcmp(value, "input") == 0)
+                    {
+                        loaded->output_timestamp = timestamp_input;
+                    }
+                    else if (strcmp(value, "emit") == 0)
+                    {
+                        loaded->output_timestamp = timestamp_emit;
+                    }
+                    else if (strcmp(value, "none") == 0)
+                    {
+                        loaded->output_timestamp = timestamp_none;
+                    }
+                    else
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else
+                {
+                    error("error: unknown output setting: %s\n", key);
+                }
+                break;
+            }
+            case configuration_performance:
+            {
+                char* tokens = line;
+                char* key = trim_string(strsep(&tokens, "="));
+                char* value = tokens ? trim_string(tokens) : "";
+                if (strcmp(key, "Engine") == 0)
+                {
+                    if (strcmp(value, "syscall") == 0)
+                    {
+                        loaded->performance_engine = engine_syscall;
+                    }
+                    else if (strcmp(value, "io_uring") == 0)
+                    {
+                        loaded->performance_engine = engine_io_uring;
+                    }
+                    else
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else if (strcmp(key, "BusyPoll") == 0)
+                {
+                    if (parse_integer(value, 0, MAX_BUSY_POLL, &loaded->performance_busy_poll) != EXIT_SUCCESS)
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else if (strcmp(key, "Priority") == 0)
+                {
+                    if (parse_integer(value, 0, 99, &loaded->performance_priority) != EXIT_SUCCESS)
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else if (strcmp(key, "Affinity") == 0)
+                {
+                    if (strlen(value) >= sizeof(loaded->performance_affinity))
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                    else
+                    {
+                        strcpy(loaded->performance_affinity, value);
+                    }
+                }
+                else if (strcmp(key, "LockMemory") == 0)
+                {
+                    if (parse_boolean(value, &loaded->performance_lock_memory) != EXIT_SUCCESS)
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else if (strcmp(key, "Warmup") == 0)
+                {
+                    if (parse_boolean(value, &loaded->performance_warm_up) != EXIT_SUCCESS)
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else if (strcmp(key, "Pipeline") == 0)
+                {
+                    if (parse_boolean(value, &loaded->performance_pipeline) != EXIT_SUCCESS)
+                    {
+                        error("error: invalid value for %s: %s\n", key, value);
+                    }
+                }
+                else
+                {
+                    error("error: unknown performance setting: %s\n", key);
                 }
                 break;
             }
@@ -211,9 +523,102 @@ int read_configuration()
     {
         free(buffer);
     }
+    merge_device_bindings(loaded);
+    compile_bindings(loaded);
+    return loaded;
+}
+
+/**
+ * Frees a configuration that is no longer active.
+ * */
+void free_configuration(struct configuration* loaded)
+{
+    if (loaded == NULL || loaded == &default_configuration)
+    {
+        return;
+    }
+    for (int i = 0; i < loaded->device_selection_count; i++)
+    {
+        free(loaded->device_selections[i].keymap);
+    }
+    free(loaded);
+}
+
+/**
+ * Loads the configuration on the loader thread, then wakes the event loop.
+ * */
+static void* run_loader(void* argument)
+{
+    (void)argument;
+    struct configuration* loaded = load_configuration();
+    __atomic_store_n(&loaded_configuration, loaded, __ATOMIC_RELEASE);
+    uint64_t value = 1;
+    if (write(loader_watcher.file_descriptor, &value, sizeof(value)) < 0)
+    {
+        error("error: failed to signal the loaded configuration: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+/**
+ * Takes the configuration from the loader thread, on the event loop.
+ * */
+static void on_configuration_loaded(struct watcher* watcher, uint32_t events)
+{
+    (void)events;
+    pthread_join(loader_thread, NULL);
+    reactor_remove(watcher);
+    close(watcher->file_descriptor);
+    watcher->file_descriptor = -1;
+    struct configuration* loaded = __atomic_exchange_n(&loaded_configuration, NULL, __ATOMIC_ACQUIRE);
+    loader_callback(loaded);
+}
+
+/**
+ * Reads and compiles the configuration file on a background thread.
+ * */
+int load_configuration_async(void (*on_loaded)(struct configuration* loaded))
+{
+    if (loader_watcher.file_descriptor >= 0)
+    {
+        // A load is in flight and its callback still comes, it may have read the file before this change
+        // The caller starts another load after that callback to pick up the change
+        return EXIT_SUCCESS;
+    }
+    loader_watcher.file_descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loader_watcher.on_ready = on_configuration_loaded;
+    if (loader_watcher.file_descriptor < 0)
+    {
+        error("error: failed to create the configuration loader event: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    loader_callback = on_loaded;
+    if (reactor_add(&loader_watcher, EPOLLIN) != EXIT_SUCCESS)
+    {
+        close(loader_watcher.file_descriptor);
+        loader_watcher.file_descriptor = -1;
+        return EXIT_FAILURE;
+    }
+    int result = pthread_create(&loader_thread, NULL, run_loader, NULL);
+    if (result != 0)
+    {
+        error("error: failed to start the configuration loader: %s\n", strerror(result));
+        reactor_remove(&loader_watcher);
+        close(loader_watcher.file_descriptor);
+        loader_watcher.file_descriptor = -1;
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 
+/**
+ * Makes a configuration the active configuration, and returns the previous one.
+ * */
+struct configuration* activate_configuration(struct configuration* loaded)
+{
+    return __atomic_exchange_n(&configuration, loaded, __ATOMIC_ACQ_REL);
+}
+
 /**
  * Helper method to print existing keyboard devices.
  * Does not work for bluetooth keyboards.
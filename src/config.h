@@ -1,17 +1,21 @@
 #ifndef config_h
 #define config_h
 
+#include <linux/input.h>
+
+#include "engine.h"
+
 #define MAX_SEQUENCE 4
 
 /**
- * The configuration file path.
+ * The maximum number of input devices captured at once.
  * */
-extern char configuration_file_path[256];
+#define MAX_INPUT_DEVICES 8
 
 /**
- * The hyper key.
+ * The configuration file path.
  * */
-extern int hyperKey;
+extern char configuration_file_path[256];
 
 /**
  * Map for keys and their conversion.
@@ -19,13 +23,136 @@ extern int hyperKey;
 struct key_output
 {
 	int sequence[MAX_SEQUENCE];
+	/**
+	 * Prebuilt output frames, indexed by the event value (release, press, repeat).
+	 * Each frame ends with a SYN_REPORT (one per key if output_frame_per_key is set).
+	 * */
+	struct input_event frames[3][MAX_SEQUENCE * 2];
+	int frame_length;
+};
+
+/**
+ * An input device selected by a [Device] section.
+ * */
+struct device_selection
+{
+    /**
+     * The device line used to search for the device, also used to match per-device bindings.
+     * */
+    char configuration[256];
+    /**
+     * The event path found for the device, or empty.
+     * */
+    char event_path[256];
+    /**
+     * The bindings of a [Bindings:<device line>] section, or NULL to use the global bindings.
+     * Owned by the configuration.
+     * */
+    struct key_output* keymap;
+};
+
+/**
+ * How output events are timestamped.
+ * */
+enum timestamps
+{
+    // Carry the timestamp of the input event that produced the output
+    timestamp_input,
+    // Stamp the output with the time it is written
+    timestamp_emit,
+    // Leave the timestamp to the kernel
+    timestamp_none
+};
+
+/**
+ * What the mapper does with a key in the idle state.
+ * */
+enum key_actions
+{
+    // Written as it came, the key is neither remapped nor the hyper key
+    key_action_pass,
+    // Written with its remapped code
+    key_action_remap,
+    // Starts the hyper state
+    key_action_hyper
+};
+
+/**
+ * A compiled configuration file.
+ * A configuration is not modified once it is active, a reload replaces it as a whole.
+ * */
+struct configuration
+{
+    /**
+     * The hyper key.
+     * */
+    int hyperKey;
+    /**
+     * Map for keys and their conversion.
+     * */
+    struct key_output keymap[256];
+    /**
+     * Map for permanently remapped keys.
+     * */
+    int remap[256];
+    /**
+     * The action of each key in the idle state, built by compile_bindings.
+     * */
+    unsigned char key_actions[KEY_CNT];
+    /**
+     * The input devices selected by the [Device] sections.
+     * */
+    struct device_selection device_selections[MAX_INPUT_DEVICES];
+    int device_selection_count;
+    /**
+     * Emit a SYN_REPORT after every output key instead of one per input frame.
+     * Some applications depend on each key arriving in its own frame.
+     * */
+    int output_frame_per_key;
+    /**
+     * How output events are timestamped.
+     * */
+    enum timestamps output_timestamp;
+    /**
+     * The requested I/O engine.
+     * */
+    enum engines performance_engine;
+    /**
+     * How long to keep polling the input devices after each event, in microseconds (0 disables, at most MAX_BUSY_POLL).
+     * */
+    int performance_busy_poll;
+    /**
+     * The SCHED_FIFO priority (1-99), or 0 to keep the normal scheduler.
+     * */
+    int performance_priority;
+    /**
+     * The CPUs to run on, a comma separated list of numbers and ranges, or empty for all.
+     * */
+    char performance_affinity[64];
+    /**
+     * Lock all memory and prefault the stack.
+     * */
+    int performance_lock_memory;
+    /**
+     * Run synthetic events through the mapper before capturing the device.
+     * */
+    int performance_warm_up;
+    /**
+     * Read and map on one thread and write on another, connected by a lock-free ring.
+     * */
+    int performance_pipeline;
 };
-extern struct key_output keymap[256];
 
 /**
- * Map for permanently remapped keys.
+ * The active configuration.
+ * */
+extern struct configuration* configuration;
+
+/**
+ * Builds the output frames for every binding of a configuration, and the key actions.
+ * Called after the bindings, remaps, hyper key or output settings change.
  * */
-extern int remap[256];
+void compile_bindings(struct configuration* loaded);
 
 /**
  * Finds the configuration file location.
@@ -33,8 +160,29 @@ extern int remap[256];
 int find_configuration_file();
 
 /**
- * Reads the configuration file.
+ * Reads and compiles the configuration file into a new configuration.
+ * Safe to call from any thread.
+ *
+ * @return struct configuration* The configuration, or NULL if the file could not be read.
+ * */
+struct configuration* load_configuration();
+
+/**
+ * Reads and compiles the configuration file on a background thread.
+ * The callback is called from the event loop with the new configuration, or NULL on failure.
+ * Only one load runs at a time, a call while a load is in flight starts nothing new.
+ * */
+int load_configuration_async(void (*on_loaded)(struct configuration* loaded));
+
+/**
+ * Makes a configuration the active configuration, and returns the previous one.
+ * Must be called between input frames, with the pipeline stopped.
+ * */
+struct configuration* activate_configuration(struct configuration* loaded);
+
+/**
+ * Frees a configuration that is no longer active.
  * */
-int read_configuration();
+void free_configuration(struct configuration* loaded);
 
 #endif
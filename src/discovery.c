@@ -0,0 +1,250 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffers.h"
+#include "discovery.h"
+#include "strings.h"
+
+#ifndef SYSFS_INPUT_PATH
+#define SYSFS_INPUT_PATH "/sys/class/input"
+#endif
+
+/**
+ * The number of event devices the index holds.
+ * */
+#define MAX_DISCOVERED_DEVICES 64
+
+/**
+ * The number of index slots, each device has three keys. Must be a power of two.
+ * */
+#define INDEX_SLOTS 256
+
+/**
+ * An input event device, as described by sysfs.
+ * */
+struct discovered_device
+{
+    // The number of the parent input device, which orders the devices by registration
+    int input_number;
+    char event[32];
+    char name[256];
+    char phys[256];
+    unsigned int vendor;
+    unsigned int product;
+};
+
+/**
+ * A device key and instance number, and the device it selects.
+ * */
+struct index_slot
+{
+    char key[272];
+    int number;
+    // The index in devices, or -1 if the slot is empty
+    int device;
+};
+
+static struct discovered_device devices[MAX_DISCOVERED_DEVICES];
+static int device_count = 0;
+static struct index_slot slots[INDEX_SLOTS];
+static int indexed = 0;
+// Guards the index, the configuration loader thread searches it too
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Hashes a device key and instance number (FNV-1a).
+ * */
+static unsigned int hash_key(const char* key, int number)
+{
+    uint32_t hash = 2166136261u;
+    for (const char* c = key; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t)number) * 16777619u;
+    return hash;
+}
+
+/**
+ * Finds the slot of a device key and instance number, or the empty slot where it belongs.
+ * */
+static struct index_slot* find_slot(const char* key, int number)
+{
+    unsigned int slot = hash_key(key, number) & (INDEX_SLOTS - 1);
+    for (int probe = 0; probe < INDEX_SLOTS; probe++)
+    {
+        struct index_slot* candidate = &slots[(slot + probe) & (INDEX_SLOTS - 1)];
+        if (candidate->device < 0 || (candidate->number == number && strcmp(candidate->key, key) == 0))
+        {
+            return candidate;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Adds a key of a device to the index, as the next instance of the key.
+ * */
+static void index_key(const char* key, int device)
+{
+    for (int number = 1;; number++)
+    {
+        struct index_slot* slot = find_slot(key, number);
+        if (slot == NULL)
+        {
+            return;
+        }
+        if (slot->device < 0)
+        {
+            snprintf(slot->key, sizeof(slot->key), "%s", key);
+            slot->number = number;
+            slot->device = device;
+            return;
+        }
+    }
+}
+
+/**
+ * Reads a sysfs attribute of an event device, without the trailing newline.
+ * */
+static int read_attribute(const char* event, const char* attribute, char* value, size_t size)
+{
+    char path[128];
+    snprintf(path, sizeof(path), SYSFS_INPUT_PATH "/%s/device/%s", event, attribute);
+    value[0] = '\0';
+    int file_descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    if (file_descriptor < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    ssize_t length = read(file_descriptor, value, size - 1);
+    close(file_descriptor);
+    if (length < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    value[length] = '\0';
+    char* trimmed = trim_string(value);
+    memmove(value, trimmed, strlen(trimmed) + 1);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Orders devices by the number of their input device.
+ * */
+static int compare_devices(const void* a, const void* b)
+{
+    return ((const struct discovered_device*)a)->input_number - ((const struct discovered_device*)b)->input_number;
+}
+
+/**
+ * Enumerates the event devices in sysfs and indexes them by name, phys and id.
+ * */
+static void build_index()
+{
+    device_count = 0;
+    for (int i = 0; i < INDEX_SLOTS; i++)
+    {
+        slots[i].device = -1;
+    }
+    DIR* directory = opendir(SYSFS_INPUT_PATH);
+    if (!directory)
+    {
+        error("error: could not open " SYSFS_INPUT_PATH ": %s\n", strerror(errno));
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL && device_count < MAX_DISCOVERED_DEVICES)
+    {
+        if (!starts_with(entry->d_name, "event") || strlen(entry->d_name) >= sizeof(devices[0].event))
+        {
+            continue;
+        }
+        struct discovered_device* device = &devices[device_count];
+        strcpy(device->event, entry->d_name);
+        if (read_attribute(device->event, "name", device->name, sizeof(device->name)) != EXIT_SUCCESS)
+        {
+            continue;
+        }
+        read_attribute(device->event, "phys", device->phys, sizeof(device->phys));
+        char value[16];
+        read_attribute(device->event, "id/vendor", value, sizeof(value));
+        device->vendor = strtoul(value, NULL, 16);
+        read_attribute(device->event, "id/product", value, sizeof(value));
+        device->product = strtoul(value, NULL, 16);
+        // The device link points to the parent input device, inputN
+        char path[128];
+        char target[256];
+        snprintf(path, sizeof(path), SYSFS_INPUT_PATH "/%s/device", device->event);
+        ssize_t length = readlink(path, target, sizeof(target) - 1);
+        target[length > 0 ? length : 0] = '\0';
+        char* input = strrchr(target, '/');
+        input = input ? input + 1 : target;
+        device->input_number = starts_with(input, "input") ? atoi(input + 5) : 0;
+        device_count++;
+    }
+    closedir(directory);
+    // Instance numbers follow the registration order, as listed in /proc/bus/input/devices
+    qsort(devices, device_count, sizeof(devices[0]), compare_devices);
+    char key[272];
+    for (int i = 0; i < device_count; i++)
+    {
+        snprintf(key, sizeof(key), "Name=\"%s\"", devices[i].name);
+        index_key(key, i);
+        if (devices[i].phys[0] != '\0')
+        {
+            snprintf(key, sizeof(key), "Phys=\"%s\"", devices[i].phys);
+            index_key(key, i);
+        }
+        snprintf(key, sizeof(key), "ID=\"%04x:%04x\"", devices[i].vendor, devices[i].product);
+        index_key(key, i);
+    }
+    indexed = 1;
+    log("info: indexed %i input devices\n", device_count);
+}
+
+/**
+ * Finds the event path of an input device in the device index.
+ * The index is built from sysfs on the first search and kept until it is invalidated.
+ *
+ * @param key The device key: Name="<name>", Phys="<phys>" or ID="<vendor>:<product>" (hexadecimal).
+ * @param number The device instance number, counted among the devices with the same key.
+ * @param event_path Receives the event path.
+ * @return int EXIT_SUCCESS if the device was found.
+ * */
+int discover_device(const char* key, int number, char* event_path)
+{
+    event_path[0] = '\0';
+    pthread_mutex_lock(&index_lock);
+    if (!indexed)
+    {
+        build_index();
+    }
+    struct index_slot* slot = find_slot(key, number);
+    int result = EXIT_FAILURE;
+    if (slot != NULL && slot->device >= 0)
+    {
+        snprintf(event_path, 256, "/dev/input/%s", devices[slot->device].event);
+        result = EXIT_SUCCESS;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return result;
+}
+
+/**
+ * Drops the device index, so the next search enumerates the devices again.
+ * Called when event nodes appear or disappear.
+ * */
+void invalidate_discovery()
+{
+    pthread_mutex_lock(&index_lock);
+    indexed = 0;
+    pthread_mutex_unlock(&index_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef discovery_h
+#define discovery_h
+
+/**
+ * Finds the event path of an input device in the device index.
+ * The index is built from sysfs on the first search and kept until it is invalidated.
+ *
+ * @param key The device key: Name="<name>", Phys="<phys>" or ID="<vendor>:<product>" (hexadecimal).
+ * @param number The device instance number, counted among the devices with the same key.
+ * @param event_path Receives the event path.
+ * @return int EXIT_SUCCESS if the device was found.
+ * */
+int discover_device(const char* key, int number, char* event_path);
+
+/**
+ * Drops the device index, so the next search enumerates the devices again.
+ * Called when event nodes appear or disappear.
+ * */
+void invalidate_discovery();
+
+#endif
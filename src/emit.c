@@ -1,34 +1,562 @@
+#include <errno.h>
 #include <linux/input.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "binding.h"
+#include "buffers.h"
+#include "config.h"
 #include "emit.h"
+#include "engine.h"
+#include "keystate.h"
+#include "pipeline.h"
+#include "reactor.h"
+#include "statistics.h"
+
+/**
+ * The number of events that can be staged before a flush is forced.
+ * */
+#define OUTPUT_BUFFER_EVENTS 64
+
+// The events staged for the current frame
+static struct input_event output_buffer[OUTPUT_BUFFER_EVENTS];
+static int output_buffer_count = 0;
+
+// A prebuilt frame waiting to be written, without copying unless it is stamped
+static struct input_event* pending_frame = NULL;
+static int pending_frame_count = 0;
+
+// Set while emitted events are discarded
+static int discard = 0;
+
+// The key set that records pressed keys instead of emitting them, or NULL
+static unsigned char* capture = NULL;
+
+// The timestamp of the input frame being processed
+static struct timeval input_time = { 0, 0 };
+
+// The input device whose events are being processed
+static struct input_device* source = NULL;
+
+/**
+ * The number of events that can wait for the output device to accept them.
+ * */
+#define OUTPUT_QUEUE_EVENTS 1024
+
+// The events the output device did not accept yet
+static struct input_event output_queue[OUTPUT_QUEUE_EVENTS];
+static int output_queue_head = 0;
+static int output_queue_count = 0;
+static void on_output_ready(struct watcher* watcher, uint32_t events);
+static struct watcher output_watcher = { -1, on_output_ready };
+// Set while the output device is read for the events sent to it
+static int output_attached = 0;
+
+/**
+ * Moves the pending prebuilt frame into the staging buffer, without its SYN_REPORT.
+ * */
+static void stage_pending_frame()
+{
+    if (pending_frame == NULL)
+    {
+        return;
+    }
+    int count = pending_frame_count - 1;
+    if (output_buffer_count + count >= OUTPUT_BUFFER_EVENTS - 1)
+    {
+        struct input_event* frame = pending_frame;
+        pending_frame = NULL;
+        emit_flush();
+        pending_frame = frame;
+    }
+    memcpy(&output_buffer[output_buffer_count], pending_frame, count * sizeof(struct input_event));
+    output_buffer_count += count;
+    pending_frame = NULL;
+}
+
+/**
+ * Appends an event to the staging buffer.
+ * */
+static void stage(int type, int code, int value)
+{
+    struct input_event* e = &output_buffer[output_buffer_count++];
+    e->time.tv_sec = 0;
+    e->time.tv_usec = 0;
+    e->type = type;
+    e->code = code;
+    e->value = value;
+}
+
+/**
+ * Checks if another input device holds a key, so the press or release of the source
+ * device must not reach the output device.
+ * */
+static int is_shared_key(int code, int value)
+{
+    if (source == NULL || discard || code >= KEY_CNT)
+    {
+        return 0;
+    }
+    int held = source->held[code];
+    if (output_key_references[code] - held == 0)
+    {
+        return 0;
+    }
+    return value == 1 ? !held : value == 0 && held;
+}
+
+/**
+ * Counts the input devices holding a key on the output device.
+ * A key held on two devices is pressed by the first one and released by the last one.
+ *
+ * @return int 1 if the event should be written to the output device.
+ * */
+static int track_key(int code, int value)
+{
+    int forward = !is_shared_key(code, value);
+    if (source == NULL || discard || code >= KEY_CNT)
+    {
+        return forward;
+    }
+    if (value == 1 && !source->held[code])
+    {
+        source->held[code] = 1;
+        output_key_references[code]++;
+    }
+    else if (value == 0 && source->held[code])
+    {
+        source->held[code] = 0;
+        output_key_references[code]--;
+    }
+    return forward;
+}
+
+/**
+ * Checks if a key event would not change the output device.
+ * */
+static int is_redundant_key(int code, int value)
+{
+    if (discard)
+    {
+        return 0;
+    }
+    int down = keystate_is_down(code);
+    return value == 1 ? down : !down;
+}
 
 /**
  * Emits a key event.
+ * The event is staged until the end of the current frame, see emit_flush.
  * */
 void emit(int type, int code, int value)
 {
     // printf("emit: code=%i value=%i\n", code, value);
-    struct input_event e;
-    e.time.tv_sec = 0;
-    e.time.tv_usec = 0;
-    // Set the virtual key code / value
-    e.type = type;
-    e.code = code;
-    e.value = value;
-    write(output_file_descriptor, &e, sizeof(e));
-
-    if (type == EV_KEY)
-    {
-        // TODO: I don't like this here
-        output_device_keystate[code] = value;
-    }
-
-    // Emit a syn event
-    e.type = EV_SYN;
-    e.code = SYN_REPORT;
-    e.value = 0;
-    write(output_file_descriptor, &e, sizeof(e));
+    if (type == EV_SYN && code == SYN_REPORT)
+    {
+        emit_flush();
+        return;
+    }
+    if (capture != NULL)
+    {
+        if (type == EV_KEY && code < KEY_CNT)
+        {
+            capture[code] = value != 0;
+        }
+        return;
+    }
+    if (type == EV_KEY && !track_key(code, value))
+    {
+        return;
+    }
+    if (type == EV_KEY && !discard && !keystate_update(code, value))
+    {
+        // A press of a held key or a release of a released key changes nothing
+        statistics.output_suppressed_events++;
+        return;
+    }
+    stage_pending_frame();
+    // Keep room for the event and its syn event
+    if (output_buffer_count >= OUTPUT_BUFFER_EVENTS - 2)
+    {
+        emit_flush();
+    }
+    stage(type, code, value);
+
+    if (type == EV_KEY && configuration->output_frame_per_key)
+    {
+        stage(EV_SYN, SYN_REPORT, 0);
+    }
+}
+
+/**
+ * Emits a prebuilt frame, or an input frame passed through, that ends with a SYN_REPORT.
+ * The frame is written as is when nothing else is staged for the current frame.
+ * */
+void emit_frame(struct input_event* events, int count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    if (capture != NULL)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            emit(events[i].type, events[i].code, events[i].value);
+        }
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].type == EV_KEY && (is_shared_key(events[i].code, events[i].value) || is_redundant_key(events[i].code, events[i].value)))
+        {
+            // Some keys are held by another device or would not change the output, emit the events one by one
+            for (int j = 0; j < count; j++)
+            {
+                if (events[j].type != EV_SYN)
+                {
+                    emit(events[j].type, events[j].code, events[j].value);
+                }
+            }
+            return;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].type == EV_KEY)
+        {
+            track_key(events[i].code, events[i].value);
+            if (!discard)
+            {
+                keystate_update(events[i].code, events[i].value);
+            }
+        }
+    }
+    if (pending_frame == NULL && output_buffer_count == 0)
+    {
+        pending_frame = events;
+        pending_frame_count = count;
+        return;
+    }
+    stage_pending_frame();
+    pending_frame = events;
+    pending_frame_count = count;
+    stage_pending_frame();
+}
+
+/**
+ * Sets the timestamp of the input frame being processed.
+ * Events emitted until the next flush are stamped with it.
+ * */
+void emit_timestamp(const struct timeval* time)
+{
+    input_time = *time;
+}
+
+/**
+ * Sets the input device whose events are being processed, or NULL for events of no device.
+ * */
+void emit_source(struct input_device* device)
+{
+    source = device;
+}
+
+/**
+ * Stamps the events of an output frame and measures the latency added since the input frame.
+ * */
+static void stamp(struct input_event* events, int count)
+{
+    struct timeval time = { 0, 0 };
+    int clock = source != NULL ? source->clock : CLOCK_MONOTONIC;
+    if (input_time.tv_sec != 0 || input_time.tv_usec != 0)
+    {
+        struct timespec now;
+        clock_gettime(clock, &now);
+        long latency = (now.tv_sec - input_time.tv_sec) * 1000000L + (now.tv_nsec / 1000 - input_time.tv_usec);
+        if (latency >= 0)
+        {
+            statistics.latency_frames++;
+            statistics.latency_total += latency;
+            if (latency > statistics.latency_maximum) statistics.latency_maximum = latency;
+        }
+    }
+    switch (configuration->output_timestamp)
+    {
+        case timestamp_input:
+        {
+            // uinput expects monotonic timestamps, output without an input frame is stamped when written
+            if (clock == CLOCK_MONOTONIC && (input_time.tv_sec != 0 || input_time.tv_usec != 0))
+            {
+                time = input_time;
+                break;
+            }
+        }
+        // fall through
+        case timestamp_emit:
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            time.tv_sec = now.tv_sec;
+            time.tv_usec = now.tv_nsec / 1000;
+            break;
+        }
+        case timestamp_none:
+        {
+            return;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        events[i].time = time;
+    }
+}
+
+/**
+ * Discards emitted events instead of writing them, without touching the output key state.
+ * Used to warm up the processing path before the devices are bound.
+ * */
+void emit_discard(int enable)
+{
+    emit_flush();
+    discard = enable;
+}
+
+/**
+ * Records the keys emitted as pressed in a key set instead of emitting them, or stops with NULL.
+ * */
+void emit_capture(unsigned char* keys)
+{
+    capture = keys;
+}
+
+/**
+ * Changes the events the output device is watched for.
+ * */
+static void watch_output(uint32_t events)
+{
+    if (!output_attached)
+    {
+        events &= ~EPOLLIN;
+    }
+    if (output_watcher.file_descriptor < 0)
+    {
+        if (events == 0)
+        {
+            return;
+        }
+        output_watcher.file_descriptor = output_file_descriptor;
+        if (reactor_add(&output_watcher, events) != EXIT_SUCCESS)
+        {
+            output_watcher.file_descriptor = -1;
+        }
+    }
+    else if (events == 0)
+    {
+        reactor_remove(&output_watcher);
+        output_watcher.file_descriptor = -1;
+    }
+    else
+    {
+        reactor_modify(&output_watcher, events);
+    }
+}
+
+/**
+ * Appends events to the output queue.
+ * When the queue overflows, it is replaced by a frame releasing every held key,
+ * so the keys dropped with it cannot get stuck.
+ * */
+static void enqueue_events(const struct input_event* events, int count)
+{
+    if (output_queue_count + count > OUTPUT_QUEUE_EVENTS)
+    {
+        statistics.output_overflows++;
+        statistics.output_dropped_events += output_queue_count + count;
+        output_queue_head = 0;
+        output_queue_count = 0;
+        struct input_event release = { .type = EV_KEY, .value = 0 };
+        for (int code = keystate_next(0); code >= 0; code = keystate_next(code + 1))
+        {
+            release.code = code;
+            output_queue[output_queue_count++] = release;
+        }
+        keystate_clear();
+        clear_output_key_references();
+        if (output_queue_count > 0)
+        {
+            output_queue[output_queue_count++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+        }
+        error("error: the output device is not accepting events, released all keys\n");
+    }
+    else
+    {
+        for (int i = 0; i < count; i++)
+        {
+            output_queue[(output_queue_head + output_queue_count + i) % OUTPUT_QUEUE_EVENTS] = events[i];
+        }
+        output_queue_count += count;
+        statistics.output_queued_events += count;
+    }
+    if (output_queue_count > 0)
+    {
+        watch_output(EPOLLIN | EPOLLOUT);
+    }
+}
+
+/**
+ * Writes queued events until the queue is empty or the output device stops accepting them.
+ * */
+static void drain_output_queue()
+{
+    while (output_queue_count > 0)
+    {
+        int count = output_queue_count;
+        if (output_queue_head + count > OUTPUT_QUEUE_EVENTS)
+        {
+            count = OUTPUT_QUEUE_EVENTS - output_queue_head;
+        }
+        ssize_t result = engine_write(output_file_descriptor, &output_queue[output_queue_head], count * sizeof(struct input_event));
+        statistics.output_writes++;
+        if (result < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                return;
+            }
+            error("error: unable to write output events: %s\n", strerror(errno));
+            statistics.output_dropped_events += output_queue_count;
+            output_queue_count = 0;
+            break;
+        }
+        int written = result / sizeof(struct input_event);
+        output_queue_head = (output_queue_head + written) % OUTPUT_QUEUE_EVENTS;
+        output_queue_count -= written;
+        if (written == 0)
+        {
+            return;
+        }
+    }
+    output_queue_head = 0;
+    watch_output(EPOLLIN);
+}
+
+/**
+ * Retries the queued events once the output device is writable,
+ * and forwards the LED changes sent to the output device.
+ * */
+static void on_output_ready(struct watcher* watcher, uint32_t events)
+{
+    if (events & EPOLLOUT)
+    {
+        drain_output_queue();
+    }
+    if (events & EPOLLIN)
+    {
+        forward_output_leds();
+    }
+}
+
+/**
+ * Starts reading the events sent to the output device, such as LED changes, in the event loop.
+ * */
+void emit_attach_output()
+{
+    output_attached = 1;
+    watch_output(output_queue_count > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/**
+ * Stops watching the output device, before it is released.
+ * */
+void emit_detach_output()
+{
+    output_attached = 0;
+    if (output_watcher.file_descriptor >= 0)
+    {
+        reactor_remove(&output_watcher);
+        output_watcher.file_descriptor = -1;
+    }
+}
+
+/**
+ * Writes events to the output device, queueing what it does not accept.
+ * Events are queued behind any events that are already waiting, to keep their order.
+ * */
+static void write_events(const struct input_event* events, int count)
+{
+    if (pipeline_active)
+    {
+        int known = input_time.tv_sec != 0 || input_time.tv_usec != 0;
+        pipeline_push(events, count, known ? &input_time : NULL, source != NULL ? source->clock : CLOCK_MONOTONIC);
+        return;
+    }
+    statistics.output_events += count;
+    if (output_queue_count > 0)
+    {
+        enqueue_events(events, count);
+        drain_output_queue();
+        return;
+    }
+    ssize_t result = engine_write(output_file_descriptor, events, count * sizeof(struct input_event));
+    statistics.output_writes++;
+    if (result < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            enqueue_events(events, count);
+            return;
+        }
+        error("error: unable to write output events: %s\n", strerror(errno));
+        return;
+    }
+    int written = result / sizeof(struct input_event);
+    if (written < count)
+    {
+        enqueue_events(events + written, count - written);
+    }
+}
+
+/**
+ * Writes the staged events to the output device, terminated by a single SYN_REPORT.
+ * */
+void emit_flush()
+{
+    if (discard)
+    {
+        pending_frame = NULL;
+        output_buffer_count = 0;
+        return;
+    }
+    if (pending_frame != NULL && configuration->output_timestamp == timestamp_none)
+    {
+        // Nothing is stamped, the prebuilt frame is written as is
+        stamp(pending_frame, pending_frame_count);
+        write_events(pending_frame, pending_frame_count);
+        pending_frame = NULL;
+    }
+    else if (pending_frame != NULL)
+    {
+        // Prebuilt frames belong to the immutable configuration, they are stamped in the staging buffer
+        memcpy(output_buffer, pending_frame, pending_frame_count * sizeof(struct input_event));
+        stamp(output_buffer, pending_frame_count);
+        write_events(output_buffer, pending_frame_count);
+        pending_frame = NULL;
+    }
+    else if (output_buffer_count > 0)
+    {
+        struct input_event* last = &output_buffer[output_buffer_count - 1];
+        if (last->type != EV_SYN || last->code != SYN_REPORT)
+        {
+            stage(EV_SYN, SYN_REPORT, 0);
+        }
+        stamp(output_buffer, output_buffer_count);
+        write_events(output_buffer, output_buffer_count);
+        output_buffer_count = 0;
+    }
+    input_time.tv_sec = 0;
+    input_time.tv_usec = 0;
 }
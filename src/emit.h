@@ -1,9 +1,60 @@
 #ifndef emit_h
 #define emit_h
 
+#include <linux/input.h>
+
 /**
  * Emits a key event.
+ * The event is staged until the end of the current frame, see emit_flush.
  * */
 void emit(int type, int code, int value);
 
+/**
+ * Emits a prebuilt frame, or an input frame passed through, that ends with a SYN_REPORT.
+ * The frame is written as is when nothing else is staged for the current frame.
+ * */
+void emit_frame(struct input_event* events, int count);
+
+/**
+ * Sets the timestamp of the input frame being processed.
+ * Events emitted until the next flush are stamped with it.
+ * */
+void emit_timestamp(const struct timeval* time);
+
+struct input_device;
+
+/**
+ * Sets the input device whose events are being processed, or NULL for events of no device.
+ * Keys held on several devices are only released when the last device releases them.
+ * */
+void emit_source(struct input_device* device);
+
+/**
+ * Discards emitted events instead of writing them, without touching the output key state.
+ * Used to warm up the processing path before the devices are bound.
+ * */
+void emit_discard(int enable);
+
+/**
+ * Records the keys emitted as pressed in a key set of KEY_CNT entries instead of emitting them,
+ * or stops recording with NULL. Used to find the output keys a mapper state implies.
+ * */
+void emit_capture(unsigned char* keys);
+
+/**
+ * Starts reading the events sent to the output device, such as LED changes, in the event loop.
+ * Called once the output device is bound.
+ * */
+void emit_attach_output();
+
+/**
+ * Stops watching the output device, before it is released.
+ * */
+void emit_detach_output();
+
+/**
+ * Writes the staged events to the output device, terminated by a single SYN_REPORT.
+ * */
+void emit_flush();
+
 #endif
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffers.h"
+#include "engine.h"
+#include "reactor.h"
+#include "statistics.h"
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+enum engines engine = engine_syscall;
+
+// The busy polling window in nanoseconds
+static long busy_poll = 0;
+// When the current busy polling window ends, in monotonic nanoseconds
+static long busy_poll_deadline = 0;
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ * */
+static long monotonic_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Reads from a reader's file descriptor once it is ready (syscall engine).
+ * */
+static void on_reader_ready(struct watcher* watcher, uint32_t events)
+{
+    struct reader* reader = (struct reader*)watcher;
+    size_t length;
+    void* buffer = reader->next_buffer(reader, &length);
+    ssize_t result = read(watcher->file_descriptor, buffer, length);
+    statistics.syscalls++;
+    reader->on_read(reader, result);
+}
+
+#ifdef USE_IO_URING
+
+/**
+ * The number of submission queue entries.
+ * */
+#define RING_ENTRIES 64
+
+// Completion tags, stored in the low bits of the user data
+#define TAG_READ 0
+#define TAG_POLL 2
+#define TAG_IGNORE 3
+#define TAG_MASK 3
+
+// The ring
+static int ring_descriptor = -1;
+static void* ring_memory = NULL;
+static size_t ring_memory_size = 0;
+static void* completion_memory = NULL;
+static size_t completion_memory_size = 0;
+static struct io_uring_sqe* submission_entries = NULL;
+static size_t submission_entries_size = 0;
+static unsigned* submission_head;
+static unsigned* submission_tail;
+static unsigned* submission_mask;
+static unsigned* submission_array;
+static unsigned* completion_head;
+static unsigned* completion_tail;
+static unsigned* completion_mask;
+static struct io_uring_cqe* completion_entries;
+static unsigned pending_submissions = 0;
+
+// Set while the epoll descriptor of the reactor is polled through the ring
+static int reactor_polled = 0;
+static struct __kernel_timespec wait_timeout;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    statistics.syscalls++;
+    return (int)syscall(__NR_io_uring_enter, ring_descriptor, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(unsigned opcode, void* argument, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, ring_descriptor, opcode, argument, count);
+}
+
+/**
+ * Releases the ring.
+ * */
+static void release_ring()
+{
+    if (submission_entries != NULL) munmap(submission_entries, submission_entries_size);
+    if (completion_memory != NULL && completion_memory != ring_memory) munmap(completion_memory, completion_memory_size);
+    if (ring_memory != NULL) munmap(ring_memory, ring_memory_size);
+    if (ring_descriptor >= 0) close(ring_descriptor);
+    submission_entries = NULL;
+    completion_memory = NULL;
+    ring_memory = NULL;
+    ring_descriptor = -1;
+}
+
+/**
+ * Checks that the kernel supports the operations used by the engine.
+ * */
+static int probe_ring()
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (probe == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    int result = EXIT_FAILURE;
+    if (io_uring_register(IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        int operations[] = { IORING_OP_READ, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT };
+        result = EXIT_SUCCESS;
+        for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++)
+        {
+            if (operations[i] > probe->last_op || !(probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED))
+            {
+                result = EXIT_FAILURE;
+            }
+        }
+    }
+    free(probe);
+    return result;
+}
+
+/**
+ * Creates and maps the ring.
+ * */
+static int create_ring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_descriptor = io_uring_setup(RING_ENTRIES, &params);
+    if (ring_descriptor < 0)
+    {
+        warn("warning: io_uring is unavailable: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (probe_ring() != EXIT_SUCCESS)
+    {
+        warn("warning: io_uring does not support the required operations\n");
+        release_ring();
+        return EXIT_FAILURE;
+    }
+    ring_memory_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    completion_memory_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (completion_memory_size > ring_memory_size) ring_memory_size = completion_memory_size;
+    }
+    ring_memory = mmap(NULL, ring_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQ_RING);
+    if (ring_memory == MAP_FAILED)
+    {
+        ring_memory = NULL;
+        release_ring();
+        return EXIT_FAILURE;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        completion_memory = ring_memory;
+    }
+    else
+    {
+        completion_memory = mmap(NULL, completion_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_CQ_RING);
+        if (completion_memory == MAP_FAILED)
+        {
+            completion_memory = NULL;
+            release_ring();
+            return EXIT_FAILURE;
+        }
+    }
+    submission_entries_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    submission_entries = mmap(NULL, submission_entries_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQES);
+    if (submission_entries == MAP_FAILED)
+    {
+        submission_entries = NULL;
+        release_ring();
+        return EXIT_FAILURE;
+    }
+    submission_head = (unsigned*)((char*)ring_memory + params.sq_off.head);
+    submission_tail = (unsigned*)((char*)ring_memory + params.sq_off.tail);
+    submission_mask = (unsigned*)((char*)ring_memory + params.sq_off.ring_mask);
+    submission_array = (unsigned*)((char*)ring_memory + params.sq_off.array);
+    completion_head = (unsigned*)((char*)completion_memory + params.cq_off.head);
+    completion_tail = (unsigned*)((char*)completion_memory + params.cq_off.tail);
+    completion_mask = (unsigned*)((char*)completion_memory + params.cq_off.ring_mask);
+    completion_entries = (struct io_uring_cqe*)((char*)completion_memory + params.cq_off.cqes);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Submits the queued entries and optionally waits for completions.
+ * */
+static int enter(unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int result = io_uring_enter(pending_submissions, min_complete, flags);
+    if (result < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        {
+            return 0;
+        }
+        error("error: io_uring_enter: %s\n", strerror(errno));
+        return -1;
+    }
+    pending_submissions -= result;
+    return result;
+}
+
+/**
+ * Returns a cleared submission entry, submitting queued entries if the queue is full.
+ * */
+static struct io_uring_sqe* get_submission_entry()
+{
+    unsigned tail = *submission_tail;
+    if (tail - __atomic_load_n(submission_head, __ATOMIC_ACQUIRE) >= RING_ENTRIES)
+    {
+        enter(0);
+        if (tail - __atomic_load_n(submission_head, __ATOMIC_ACQUIRE) >= RING_ENTRIES)
+        {
+            return NULL;
+        }
+    }
+    unsigned index = tail & *submission_mask;
+    struct io_uring_sqe* entry = &submission_entries[index];
+    memset(entry, 0, sizeof(*entry));
+    submission_array[index] = index;
+    return entry;
+}
+
+/**
+ * Publishes the last entry returned by get_submission_entry.
+ * */
+static void queue_submission_entry()
+{
+    __atomic_store_n(submission_tail, *submission_tail + 1, __ATOMIC_RELEASE);
+    pending_submissions++;
+}
+
+/**
+ * Posts a read for the reader.
+ * */
+static int post_read(struct reader* reader)
+{
+    struct io_uring_sqe* entry = get_submission_entry();
+    if (entry == NULL)
+    {
+        error("error: the io_uring submission queue is full\n");
+        return EXIT_FAILURE;
+    }
+    size_t length;
+    void* buffer = reader->next_buffer(reader, &length);
+    entry->opcode = IORING_OP_READ;
+    entry->fd = reader->watcher.file_descriptor;
+    entry->addr = (unsigned long)buffer;
+    entry->len = length;
+    entry->off = (__u64)-1;
+    entry->user_data = (unsigned long)reader | TAG_READ;
+    queue_submission_entry();
+    reader->posted = 1;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Polls the epoll descriptor of the reactor through the ring.
+ * */
+static int post_reactor_poll()
+{
+    struct io_uring_sqe* entry = get_submission_entry();
+    if (entry == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    entry->opcode = IORING_OP_POLL_ADD;
+    entry->fd = reactor_descriptor();
+    entry->poll32_events = POLLIN;
+    entry->user_data = TAG_POLL;
+    queue_submission_entry();
+    reactor_polled = 1;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Handles the available completions.
+ * */
+static int reap_completions()
+{
+    int count = 0;
+    unsigned head = *completion_head;
+    while (head != __atomic_load_n(completion_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe* completion = &completion_entries[head & *completion_mask];
+        unsigned long data = completion->user_data;
+        int result = completion->res;
+        head++;
+        __atomic_store_n(completion_head, head, __ATOMIC_RELEASE);
+        switch (data & TAG_MASK)
+        {
+            case TAG_READ:
+            {
+                struct reader* reader = (struct reader*)(data & ~(unsigned long)TAG_MASK);
+                reader->posted = 0;
+                if (reader->stopping)
+                {
+                    break;
+                }
+                if (result < 0)
+                {
+                    errno = -result;
+                    result = -1;
+                }
+                reader->on_read(reader, result);
+                // The callback may have stopped the reader
+                if (!reader->stopping && !reader->posted)
+                {
+                    post_read(reader);
+                }
+                count++;
+                break;
+            }
+            case TAG_POLL:
+            {
+                reactor_polled = 0;
+                statistics.syscalls++;
+                int dispatched = reactor_wait(0);
+                if (dispatched > 0)
+                {
+                    count += dispatched;
+                }
+                break;
+            }
+            case TAG_IGNORE:
+            default:
+            {
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+#endif
+
+/**
+ * Starts the requested engine, falling back to the syscall engine if it is unavailable.
+ * */
+int engine_initialize(enum engines requested)
+{
+    engine = engine_syscall;
+    if (requested == engine_io_uring)
+    {
+#ifdef USE_IO_URING
+        if (create_ring() == EXIT_SUCCESS)
+        {
+            engine = engine_io_uring;
+            log("info: using the io_uring engine\n");
+            return EXIT_SUCCESS;
+        }
+        warn("warning: falling back to the syscall engine\n");
+#else
+        warn("warning: io_uring support was not built, falling back to the syscall engine\n");
+#endif
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Sets how long the syscall engine keeps polling after each event before blocking again.
+ *
+ * @param microseconds The polling window, up to MAX_BUSY_POLL, or 0 to disable busy polling.
+ * */
+void engine_set_busy_poll(int microseconds)
+{
+    if (microseconds > MAX_BUSY_POLL)
+    {
+        microseconds = MAX_BUSY_POLL;
+    }
+    busy_poll = microseconds * 1000L;
+    busy_poll_deadline = 0;
+    if (busy_poll > 0 && engine == engine_io_uring)
+    {
+        warn("warning: busy polling is not used with the io_uring engine\n");
+    }
+}
+
+/**
+ * Releases the engine.
+ * */
+void engine_release()
+{
+#ifdef USE_IO_URING
+    if (engine == engine_io_uring)
+    {
+        if (pending_submissions > 0)
+        {
+            enter(0);
+        }
+        release_ring();
+        reactor_polled = 0;
+        pending_submissions = 0;
+    }
+#endif
+    engine = engine_syscall;
+}
+
+/**
+ * Starts reading from the reader's file descriptor.
+ * */
+int engine_start_reader(struct reader* reader)
+{
+    reader->stopping = 0;
+    reader->posted = 0;
+#ifdef USE_IO_URING
+    if (engine == engine_io_uring)
+    {
+        return post_read(reader);
+    }
+#endif
+    reader->watcher.on_ready = on_reader_ready;
+    // Busy polling needs reads that return instead of blocking
+    int flags = fcntl(reader->watcher.file_descriptor, F_GETFL);
+    if (flags >= 0)
+    {
+        fcntl(reader->watcher.file_descriptor, F_SETFL, flags | O_NONBLOCK);
+    }
+    return reactor_add(&reader->watcher, EPOLLIN);
+}
+
+/**
+ * Stops reading from the reader's file descriptor.
+ * Any posted read is cancelled before this returns.
+ * */
+void engine_stop_reader(struct reader* reader)
+{
+    reader->stopping = 1;
+#ifdef USE_IO_URING
+    if (engine == engine_io_uring)
+    {
+        if (!reader->posted)
+        {
+            return;
+        }
+        struct io_uring_sqe* entry = get_submission_entry();
+        if (entry != NULL)
+        {
+            entry->opcode = IORING_OP_ASYNC_CANCEL;
+            entry->addr = (unsigned long)reader | TAG_READ;
+            entry->user_data = TAG_IGNORE;
+            queue_submission_entry();
+        }
+        while (reader->posted)
+        {
+            if (enter(1) < 0)
+            {
+                break;
+            }
+            reap_completions();
+        }
+        return;
+    }
+#endif
+    reactor_remove(&reader->watcher);
+}
+
+/**
+ * Writes a buffer to a file descriptor.
+ * Writes stay on the syscall with both engines, so the caller sees a short or failed write
+ * and queues the rest in order, io_uring would only report it after the next wait.
+ *
+ * @return ssize_t The number of bytes written, or -1 on error.
+ * */
+ssize_t engine_write(int file_descriptor, const void* buffer, size_t length)
+{
+    statistics.syscalls++;
+    return write(file_descriptor, buffer, length);
+}
+
+/**
+ * Waits for readers and watchers and dispatches them.
+ *
+ * @param timeout The timeout in milliseconds, or -1 to wait indefinitely.
+ * @return int The number of dispatched events, or -1 on error.
+ * */
+int engine_wait(int timeout)
+{
+#ifdef USE_IO_URING
+    if (engine == engine_io_uring)
+    {
+        if (!reactor_polled && post_reactor_poll() != EXIT_SUCCESS)
+        {
+            return -1;
+        }
+        unsigned min_complete = 1;
+        if (timeout == 0)
+        {
+            min_complete = 0;
+        }
+        else if (timeout > 0)
+        {
+            // Completes on the first other completion or when the timeout expires
+            struct io_uring_sqe* entry = get_submission_entry();
+            if (entry != NULL)
+            {
+                wait_timeout.tv_sec = timeout / 1000;
+                wait_timeout.tv_nsec = (timeout % 1000) * 1000000L;
+                entry->opcode = IORING_OP_TIMEOUT;
+                entry->addr = (unsigned long)&wait_timeout;
+                entry->len = 1;
+                entry->off = 1;
+                entry->user_data = TAG_IGNORE;
+                queue_submission_entry();
+            }
+        }
+        if (enter(min_complete) < 0)
+        {
+            return -1;
+        }
+        return reap_completions();
+    }
+#endif
+    if (busy_poll > 0 && timeout < 0)
+    {
+        // Inside a window the whole reactor is polled without sleeping, until something is ready or the window ends
+        // This trades a core for the scheduler wake-up latency between keystrokes
+        while (monotonic_time() < busy_poll_deadline)
+        {
+            statistics.syscalls++;
+            int dispatched = reactor_wait(0);
+            if (dispatched > 0)
+            {
+                // Every event extends the window, the loop still runs after each dispatch
+                statistics.busy_poll_hits++;
+                busy_poll_deadline = monotonic_time() + busy_poll;
+            }
+            if (dispatched != 0)
+            {
+                return dispatched;
+            }
+            statistics.busy_poll_spins++;
+        }
+    }
+    statistics.syscalls++;
+    int dispatched = reactor_wait(timeout);
+    if (busy_poll > 0 && dispatched > 0)
+    {
+        // A window starts after each event
+        busy_poll_deadline = monotonic_time() + busy_poll;
+        statistics.busy_poll_windows++;
+    }
+    return dispatched;
+}
@@ -0,0 +1,97 @@
+#ifndef engine_h
+#define engine_h
+
+#include <sys/types.h>
+
+#include "reactor.h"
+
+/**
+ * The I/O engines used for the input and output devices.
+ * */
+enum engines
+{
+    engine_syscall,
+    engine_io_uring
+};
+
+/**
+ * The active engine.
+ * */
+extern enum engines engine;
+
+/**
+ * A file descriptor that is continuously read from.
+ * */
+struct reader
+{
+    /**
+     * The watcher used by the syscall engine. Must be the first member.
+     * */
+    struct watcher watcher;
+    /**
+     * Returns where the next read should be stored and how many bytes it may hold.
+     * */
+    void* (*next_buffer)(struct reader* reader, size_t* length);
+    /**
+     * Called with the result of every completed read, as returned by read(2).
+     * */
+    void (*on_read)(struct reader* reader, ssize_t result);
+    /**
+     * Set while a read is posted to the io_uring engine.
+     * */
+    int posted;
+    /**
+     * Set while the reader is being stopped.
+     * */
+    int stopping;
+};
+
+/**
+ * Starts the requested engine, falling back to the syscall engine if it is unavailable.
+ * */
+int engine_initialize(enum engines requested);
+
+/**
+ * The longest busy polling window, in microseconds.
+ * */
+#define MAX_BUSY_POLL 1000000
+
+/**
+ * Sets how long the syscall engine keeps polling after each event before blocking again.
+ *
+ * @param microseconds The polling window, up to MAX_BUSY_POLL, or 0 to disable busy polling.
+ * */
+void engine_set_busy_poll(int microseconds);
+
+/**
+ * Releases the engine.
+ * */
+void engine_release();
+
+/**
+ * Starts reading from the reader's file descriptor.
+ * */
+int engine_start_reader(struct reader* reader);
+
+/**
+ * Stops reading from the reader's file descriptor.
+ * Any posted read is cancelled before this returns.
+ * */
+void engine_stop_reader(struct reader* reader);
+
+/**
+ * Writes a buffer to a file descriptor, with a syscall for both engines.
+ *
+ * @return ssize_t The number of bytes written, or -1 on error.
+ * */
+ssize_t engine_write(int file_descriptor, const void* buffer, size_t length);
+
+/**
+ * Waits for readers and watchers and dispatches them.
+ *
+ * @param timeout The timeout in milliseconds, or -1 to wait indefinitely.
+ * @return int The number of dispatched events, or -1 on error.
+ * */
+int engine_wait(int timeout);
+
+#endif
@@ -0,0 +1,101 @@
+#include <linux/input.h>
+#include <string.h>
+
+#include "keystate.h"
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define KEYSTATE_WORDS ((KEY_CNT + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+// One bit per key held on the output device
+static unsigned long keys[KEYSTATE_WORDS];
+
+/**
+ * Checks if a key is held on the output device.
+ * */
+int keystate_is_down(int code)
+{
+    if (code < 0 || code >= KEY_CNT)
+    {
+        return 0;
+    }
+    return (keys[code / BITS_PER_WORD] >> (code % BITS_PER_WORD)) & 1;
+}
+
+/**
+ * Updates the output key state with a key event.
+ * A repeat is accepted for a key that is held.
+ *
+ * @return int 1 if the event changes the output device, 0 if it is redundant.
+ * */
+int keystate_update(int code, int value)
+{
+    if (code < 0 || code >= KEY_CNT)
+    {
+        // Not tracked, always written
+        return 1;
+    }
+    unsigned long bit = 1UL << (code % BITS_PER_WORD);
+    unsigned long* word = &keys[code / BITS_PER_WORD];
+    int down = (*word & bit) != 0;
+    switch (value)
+    {
+        case 0:
+            *word &= ~bit;
+            return down;
+        case 1:
+            *word |= bit;
+            return !down;
+        default:
+            return down;
+    }
+}
+
+/**
+ * Finds the first key held on the output device, starting at a key code.
+ *
+ * @return int The key code, or -1 if no key from the code on is held.
+ * */
+int keystate_next(int code)
+{
+    if (code < 0)
+    {
+        code = 0;
+    }
+    if (code >= KEY_CNT)
+    {
+        return -1;
+    }
+    size_t index = code / BITS_PER_WORD;
+    // Skip the keys below the code in its word
+    unsigned long word = keys[index] & (~0UL << (code % BITS_PER_WORD));
+    while (word == 0)
+    {
+        if (++index >= KEYSTATE_WORDS)
+        {
+            return -1;
+        }
+        word = keys[index];
+    }
+    return index * BITS_PER_WORD + __builtin_ctzl(word);
+}
+
+/**
+ * Returns the number of keys held on the output device.
+ * */
+int keystate_count()
+{
+    int count = 0;
+    for (size_t i = 0; i < KEYSTATE_WORDS; i++)
+    {
+        count += __builtin_popcountl(keys[i]);
+    }
+    return count;
+}
+
+/**
+ * Marks every key as released.
+ * */
+void keystate_clear()
+{
+    memset(keys, 0, sizeof(keys));
+}
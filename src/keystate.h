@@ -0,0 +1,40 @@
+#ifndef keystate_h
+#define keystate_h
+
+/**
+ * The keys held on the output device, as a packed bitset.
+ * Events that would not change it are redundant and are not written.
+ * */
+
+/**
+ * Updates the output key state with a key event.
+ * A repeat is accepted for a key that is held.
+ *
+ * @return int 1 if the event changes the output device, 0 if it is redundant.
+ * */
+int keystate_update(int code, int value);
+
+/**
+ * Checks if a key is held on the output device.
+ * */
+int keystate_is_down(int code);
+
+/**
+ * Finds the first key held on the output device, starting at a key code.
+ * Iterate with: for (code = keystate_next(0); code >= 0; code = keystate_next(code + 1))
+ *
+ * @return int The key code, or -1 if no key from the code on is held.
+ * */
+int keystate_next(int code);
+
+/**
+ * Returns the number of keys held on the output device.
+ * */
+int keystate_count();
+
+/**
+ * Marks every key as released.
+ * */
+void keystate_clear();
+
+#endif
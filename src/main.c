@@ -2,168 +2,647 @@
 #include <errno.h>
 #include <limits.h>
 #include <linux/input.h>
-#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "binding.h"
 #include "buffers.h"
 #include "config.h"
+#include "discovery.h"
 #include "emit.h"
+#include "engine.h"
 #include "mapper.h"
+#include "performance.h"
+#include "pipeline.h"
+#include "reactor.h"
+#include "statistics.h"
+#include "upgrade.h"
 
-volatile sig_atomic_t should_reload = 0;
-volatile sig_atomic_t should_exit = 0;
-static int inotify_descriptor;
-static int watch_descriptor;
-static pthread_t main_thread_identifier;
-static pthread_t watch_thread_identifier;
+static int should_reload = 0;
+static int should_upgrade = 0;
+static int should_exit = 0;
+static int exit_status = EXIT_SUCCESS;
+static int watch_descriptor = -1;
+static int input_watch_descriptor = -1;
+static int should_reconnect = 0;
+static int input_lost = 0;
+static int input_grabbed = 0;
+// The executable that is run again on upgrade, resolved at startup so a replaced binary is picked up
+static char executable_path[PATH_MAX] = { '\0' };
+// Set if the readers run on the pipeline threads
+static int readers_in_pipeline = 0;
+// Set while the loader thread reads the configuration file
+static int configuration_loading = 0;
+// Set when the loader thread is done, with the configuration it loaded or NULL
+static int configuration_loaded = 0;
+static struct configuration* pending_configuration = NULL;
+
+// The readers of the input devices while the pipeline runs
+static struct reader* pipeline_readers[MAX_INPUT_DEVICES];
+
+static void on_signal_ready(struct watcher* watcher, uint32_t events);
+static void on_watch_ready(struct watcher* watcher, uint32_t events);
+static void on_reload_timer(struct watcher* watcher, uint32_t events);
+static void* next_input_buffer(struct reader* reader, size_t* length);
+static void on_input_read(struct reader* reader, ssize_t result);
+static struct watcher signal_watcher = { -1, on_signal_ready };
+static struct watcher watch_watcher = { -1, on_watch_ready };
+static struct watcher reload_timer_watcher = { -1, on_reload_timer };
+
+/**
+ * How long the configuration file must stay unchanged before it is reloaded, in milliseconds.
+ * Editors that write in several chunks or save by rename produce bursts of events.
+ * */
+#define RELOAD_DELAY 100
+
+// Set while a reload waits for the configuration file to settle
+static int reload_pending = 0;
+
+/**
+ * Handles signals delivered through the signal file descriptor.
+ * */
+static void on_signal_ready(struct watcher* watcher, uint32_t events)
+{
+    struct signalfd_siginfo info;
+    while (read(watcher->file_descriptor, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGHUP)
+        {
+            should_reload = 1;
+        }
+        else if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM)
+        {
+            __atomic_store_n(&should_exit, 1, __ATOMIC_RELEASE);
+        }
+        else if (info.ssi_signo == SIGUSR2)
+        {
+            should_upgrade = 1;
+        }
+        else if (info.ssi_signo == SIGUSR1)
+        {
+            print_statistics();
+        }
+    }
+}
+
+/**
+ * Blocks the handled signals and receives them through a file descriptor instead.
+ * */
+static int attach_signal_handlers()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0)
+    {
+        error("error: failed to block signals: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    signal_watcher.file_descriptor = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_watcher.file_descriptor < 0)
+    {
+        error("error: failed to create the signal file descriptor: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return reactor_add(&signal_watcher, EPOLLIN);
+}
+
+/**
+ * Returns the name of the configuration file, without its directory.
+ * */
+static const char* configuration_file_name()
+{
+    const char* separator = strrchr(configuration_file_path, '/');
+    return separator != NULL ? separator + 1 : configuration_file_path;
+}
 
 /**
- * Handles signal events.
+ * Reloads the configuration once the file has not changed for RELOAD_DELAY.
+ * A change while a reload is pending restarts the delay instead of reloading again.
  * */
-static void on_signal(int signal)
+static void schedule_reload()
 {
-    if (signal == SIGHUP)
+    if (reload_pending)
+    {
+        statistics.reloads_avoided++;
+    }
+    struct itimerspec delay = { { 0, 0 }, { 0, RELOAD_DELAY * 1000000L } };
+    if (timerfd_settime(reload_timer_watcher.file_descriptor, 0, &delay, NULL) < 0)
     {
+        error("error: failed to start the reload timer: %s\n", strerror(errno));
         should_reload = 1;
+        return;
     }
-    else if (signal == SIGINT || signal == SIGTERM)
+    reload_pending = 1;
+}
+
+/**
+ * Starts the pending reload when the configuration file has settled.
+ * */
+static void on_reload_timer(struct watcher* watcher, uint32_t events)
+{
+    uint64_t expirations;
+    if (read(watcher->file_descriptor, &expirations, sizeof(expirations)) == sizeof(expirations))
     {
-        should_exit = 1;
+        reload_pending = 0;
+        should_reload = 1;
     }
 }
 
 /**
- * Attaches signal event handlers.
+ * Reads inotify watch events.
  * */
-static int attach_signal_handlers()
+static void on_watch_ready(struct watcher* watcher, uint32_t events)
 {
-    stack_t signal_stack;
-    if ((signal_stack.ss_sp = malloc(SIGSTKSZ)) == NULL)
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t result;
+    while ((result = read(watcher->file_descriptor, buffer, sizeof(buffer))) > 0)
+    {
+        for (char* pointer = buffer; pointer < buffer + result;)
+        {
+            struct inotify_event* event = (struct inotify_event*)pointer;
+            pointer += sizeof(struct inotify_event) + event->len;
+            if (event->wd == input_watch_descriptor)
+            {
+                if (event->len == 0 || strncmp(event->name, "event", 5) != 0)
+                {
+                    continue;
+                }
+                invalidate_discovery();
+                // An event node appeared or its permissions changed
+                if (event->mask & (IN_CREATE | IN_ATTRIB))
+                {
+                    should_reconnect = 1;
+                }
+                continue;
+            }
+            // The configuration directory, saves by write and by rename both end with one of these
+            if (event->len > 0 && strcmp(event->name, configuration_file_name()) == 0)
+            {
+                schedule_reload();
+            }
+        }
+    }
+    if (result == 0)
+    {
+        error("error: received eof while reading inotify events\n");
+        error("error: file events will no longer be processed\n");
+        reactor_remove(watcher);
+    }
+    else if (errno != EAGAIN && errno != EINTR)
+    {
+        error("error: unable to read inotify event: %s\n", strerror(errno));
+        error("error: file events will no longer be processed\n");
+        reactor_remove(watcher);
+    }
+}
+
+/**
+ * Starts watching for changes in the configuration file.
+ * The directory is watched rather than the file, so the watch survives editors that save by rename.
+ * */
+static int watch_configuration_file()
+{
+    watch_watcher.file_descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_watcher.file_descriptor < 0)
+    {
+        error("error: failed to initialize inotify: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    char directory[sizeof(configuration_file_path)];
+    strcpy(directory, configuration_file_path);
+    char* separator = strrchr(directory, '/');
+    if (separator == directory)
+    {
+        separator[1] = '\0';
+    }
+    else if (separator != NULL)
+    {
+        separator[0] = '\0';
+    }
+    else
+    {
+        strcpy(directory, ".");
+    }
+    watch_descriptor = inotify_add_watch(watch_watcher.file_descriptor, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+    if (watch_descriptor < 0)
+    {
+        error("error: failed to create the configuration file watch: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    reload_timer_watcher.file_descriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reload_timer_watcher.file_descriptor < 0)
     {
-        error("error: unable to allocate signal stack: %s\n", strerror(errno));
+        error("error: failed to create the reload timer: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
-    signal_stack.ss_size = SIGSTKSZ;
-    signal_stack.ss_flags = 0;
-    if (sigaltstack(&signal_stack, (stack_t*)0) < 0)
+    if (reactor_add(&reload_timer_watcher, EPOLLIN) != EXIT_SUCCESS)
     {
-        error("error: sigaltstack: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
-    struct sigaction signal_action;
-    signal_action.sa_flags = SA_ONSTACK;
-    sigemptyset(&signal_action.sa_mask);
-    signal_action.sa_handler = on_signal;
-    sigaction(SIGHUP, &signal_action, NULL);
-    sigaction(SIGINT, &signal_action, NULL);
-    sigaction(SIGTERM, &signal_action, NULL);
+    // Input devices that are plugged in later are captured when their event node appears
+    input_watch_descriptor = inotify_add_watch(watch_watcher.file_descriptor, "/dev/input", IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if (input_watch_descriptor < 0)
+    {
+        warn("warning: failed to watch /dev/input, devices will not be captured when they are plugged in: %s\n", strerror(errno));
+    }
+    return reactor_add(&watch_watcher, EPOLLIN);
+}
+
+/**
+ * Releases the configuration file watch.
+ * */
+static int release_configuration_file_watch()
+{
+    if (watch_descriptor > 0)
+    {
+        log("info: releasing configuration file watch\n");
+        inotify_rm_watch(watch_watcher.file_descriptor, watch_descriptor);
+    }
+    if (input_watch_descriptor > 0)
+    {
+        inotify_rm_watch(watch_watcher.file_descriptor, input_watch_descriptor);
+    }
+    if (watch_watcher.file_descriptor > 0)
+    {
+        close(watch_watcher.file_descriptor);
+    }
+    if (reload_timer_watcher.file_descriptor > 0)
+    {
+        close(reload_timer_watcher.file_descriptor);
+    }
     return EXIT_SUCCESS;
 }
 
 /**
- * Reads inotify watch events.
+ * Receives an input device that was grabbed after its keys were released.
  * */
-static void* read_watch_events()
+static void on_input_grabbed(struct input_device* device)
 {
-    struct inotify_event event;
-    while (1)
+    (void)device;
+    input_grabbed = 1;
+}
+
+/**
+ * Captures the configured input devices that are not captured yet.
+ * */
+static void bind_inputs()
+{
+    if (configuration->device_selection_count == 0)
+    {
+        error("error: no input device was configured.\n");
+    }
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        if (device->selection.configuration[0] == '\0' || device->file_descriptor >= 0)
+        {
+            continue;
+        }
+        if (bind_input(device, on_input_grabbed) != EXIT_SUCCESS)
+        {
+            error("error: could not capture the input device\n");
+            release_input(device);
+        }
+    }
+}
+
+/**
+ * Starts watching the input devices that were captured.
+ * Can be called again after more devices were captured.
+ * */
+static void attach_input()
+{
+    // The pipeline is restarted with every captured device
+    pipeline_stop();
+    int count = 0;
+    for (int i = 0; i < input_device_count; i++)
     {
-        if (should_exit)
+        struct input_device* device = &input_devices[i];
+        // A device waiting for its keys to be released is attached once it is grabbed
+        if (device->file_descriptor < 0 || !device->grabbed)
         {
-            break;
+            continue;
         }
-        ssize_t result = read(inotify_descriptor, &event, sizeof(event));
-        if (result == (ssize_t)-1)
+        if (device->reader.watcher.file_descriptor < 0)
         {
-            if (errno == EINTR)
+            // The buffer is kept, it may hold a partial frame from a stopped reader or a resumed device
+            device->disconnected = 0;
+            device->reader.next_buffer = next_input_buffer;
+            device->reader.on_read = on_input_read;
+            device->reader.watcher.file_descriptor = device->file_descriptor;
+            seed_input_keys(device, 0);
+            if (!configuration->performance_pipeline && engine_start_reader(&device->reader) != EXIT_SUCCESS)
             {
+                device->reader.watcher.file_descriptor = -1;
                 continue;
             }
-            else
-            {
-                error("error: unable to read inotify event: %s\n", strerror(errno));
-                error("error: file events will no longer be processed\n");
-                break;
-            }
         }
-        if (result == (ssize_t)0)
+        if (configuration->performance_pipeline)
         {
-            error("error: received eof while reading inotify events\n");
-            error("error: file events will no longer be processed\n");
-            break;
+            pipeline_readers[count] = &device->reader;
         }
-        if (result != sizeof(event))
+        count++;
+    }
+    readers_in_pipeline = configuration->performance_pipeline;
+    if (configuration->performance_pipeline && count > 0 && pipeline_start(pipeline_readers, count) != EXIT_SUCCESS)
+    {
+        for (int i = 0; i < count; i++)
         {
-            warn("warning: partial inotify event received\n");
-            continue;
+            pipeline_readers[i]->watcher.file_descriptor = -1;
+        }
+        count = 0;
+    }
+    if (count == 0)
+    {
+        log("info: waiting for the input device to be connected, you may also update the configuration file.\n");
+    }
+}
+
+/**
+ * Stops watching an input device, without releasing it.
+ * The pipeline must be stopped.
+ * */
+static void stop_reader(struct input_device* device)
+{
+    if (device->reader.watcher.file_descriptor >= 0)
+    {
+        if (!readers_in_pipeline)
+        {
+            engine_stop_reader(&device->reader);
         }
-        if (event.mask & IN_MODIFY)
+        device->reader.watcher.file_descriptor = -1;
+    }
+}
+
+/**
+ * Stops watching and releases the input devices.
+ * */
+static void detach_input()
+{
+    pipeline_stop();
+    for (int i = 0; i < input_device_count; i++)
+    {
+        stop_reader(&input_devices[i]);
+        release_input(&input_devices[i]);
+    }
+}
+
+/**
+ * Adopts the device selections of the active configuration.
+ * Input devices that are still selected keep their capture, reader and mapper state,
+ * the others are released. The pipeline must be stopped.
+ * */
+static void select_input_devices()
+{
+    int adopted[MAX_INPUT_DEVICES] = { 0 };
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        if (device->selection.configuration[0] == '\0')
         {
-            pthread_kill(main_thread_identifier, SIGHUP);
+            continue;
         }
-        if (event.mask & IN_DELETE_SELF)
+        int kept = -1;
+        for (int j = 0; j < configuration->device_selection_count && kept < 0; j++)
         {
-            inotify_rm_watch(inotify_descriptor, watch_descriptor);
-            watch_descriptor = inotify_add_watch(inotify_descriptor, configuration_file_path, IN_MODIFY | IN_DELETE_SELF);
-            if (watch_descriptor < 0)
+            struct device_selection* selection = &configuration->device_selections[j];
+            if (!adopted[j] && strcmp(selection->configuration, device->selection.configuration) == 0
+                && (device->file_descriptor < 0 || strcmp(selection->event_path, device->selection.event_path) == 0))
             {
-                error("error: failed to create the configuration file watch: %s\n", strerror(errno));
-                break;
+                kept = j;
             }
-            pthread_kill(main_thread_identifier, SIGHUP);
+        }
+        if (kept >= 0)
+        {
+            adopted[kept] = 1;
+            update_device_selection(device, &configuration->device_selections[kept]);
+            // Hand the held keys over to the new bindings, keys that map the same stay down
+            reconcile_device_keys(device);
+            continue;
+        }
+        stop_reader(device);
+        release_device_keys(device);
+        release_input(device);
+        drop_input_device(device);
+    }
+    for (int j = 0; j < configuration->device_selection_count; j++)
+    {
+        if (!adopted[j])
+        {
+            adopt_device_selection(&configuration->device_selections[j]);
         }
     }
-    pthread_exit(NULL);
-    return EXIT_SUCCESS;
 }
 
 /**
- * Starts watching for changes in the configuration file.
+ * Recreates the output device if the captured input devices or the bindings need more keys.
  * */
-static int watch_configuration_file()
+static int update_output()
 {
-    inotify_descriptor = inotify_init();
-    if (inotify_descriptor < 0)
+    if (!output_capabilities_changed())
     {
-        error("error: failed to initialize inotify: %s\n", strerror(errno));
+        return EXIT_SUCCESS;
+    }
+    log("info: the output device needs more keys, recreating it\n");
+    pipeline_stop();
+    release_output_keys();
+    emit_detach_output();
+    release_output();
+    if (bind_output() != EXIT_SUCCESS)
+    {
+        error("error: could not create the virtual output device\n");
         return EXIT_FAILURE;
     }
-    watch_descriptor = inotify_add_watch(inotify_descriptor, configuration_file_path, IN_MODIFY | IN_DELETE_SELF);
-    if (watch_descriptor < 0)
+    emit_attach_output();
+    // Press the keys that are still held on the running devices on the new output device
+    for (int i = 0; i < input_device_count; i++)
+    {
+        if (input_devices[i].reader.watcher.file_descriptor >= 0)
+        {
+            reconcile_device_keys(&input_devices[i]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Receives the configuration from the loader thread.
+ * */
+static void on_configuration_loaded(struct configuration* loaded)
+{
+    pending_configuration = loaded;
+    configuration_loaded = 1;
+}
+
+/**
+ * Swaps in a configuration that was loaded, then frees the previous one.
+ * The pipeline is stopped first, so the swap happens between input frames.
+ * */
+static int adopt_configuration(struct configuration* loaded)
+{
+    // The mapper and output belong to the reader thread while the pipeline runs
+    pipeline_stop();
+    struct configuration* previous = activate_configuration(loaded);
+    engine_set_busy_poll(configuration->performance_busy_poll);
+    apply_performance_profile();
+    if (configuration->performance_pipeline != readers_in_pipeline)
+    {
+        // The readers move between the event loop and the pipeline threads
+        for (int i = 0; i < input_device_count; i++)
+        {
+            stop_reader(&input_devices[i]);
+        }
+    }
+    // Unchanged devices stay captured, their readers keep running
+    select_input_devices();
+    // No device uses the bindings of the previous configuration anymore
+    free_configuration(previous);
+    bind_inputs();
+    if (update_output() != EXIT_SUCCESS)
     {
-        error("error: failed to create the configuration file watch: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
-    pthread_create(&watch_thread_identifier, NULL, read_watch_events, NULL);
+    attach_input();
     return EXIT_SUCCESS;
 }
 
 /**
- * Releases the configuration file watch.
+ * Adopts the device selections that no input device uses, after the devices were resumed.
  * */
-static int release_configuration_file_watch()
+static void adopt_unused_selections()
 {
-    if (watch_thread_identifier > 0)
+    for (int j = 0; j < configuration->device_selection_count; j++)
     {
-        pthread_kill(watch_thread_identifier, SIGTERM);
-        pthread_join(watch_thread_identifier, NULL);
+        if (find_input_device(configuration->device_selections[j].configuration) == NULL)
+        {
+            adopt_device_selection(&configuration->device_selections[j]);
+        }
     }
-    if (watch_descriptor > 0)
+}
+
+/**
+ * Finds the executable to run on upgrade.
+ * */
+static void find_executable()
+{
+    ssize_t length = readlink("/proc/self/exe", executable_path, sizeof(executable_path) - 1);
+    if (length < 0)
     {
-        log("info: releasing configuration file watch\n");
-        inotify_rm_watch(inotify_descriptor, watch_descriptor);
+        warn("warning: could not find the executable, upgrading is disabled: %s\n", strerror(errno));
+        executable_path[0] = '\0';
+        return;
     }
-    if (inotify_descriptor > 0)
+    executable_path[length] = '\0';
+    // The binary was replaced before this process started
+    char* deleted = strstr(executable_path, " (deleted)");
+    if (deleted != NULL && deleted[strlen(" (deleted)")] == '\0')
     {
-        close(inotify_descriptor);
+        *deleted = '\0';
+    }
+}
+
+/**
+ * Runs the executable again, or the new version that replaced it, handing over the devices.
+ * The input devices stay grabbed and the output device stays in place, so nothing re-probes them.
+ * */
+static void upgrade_executable()
+{
+    if (executable_path[0] == '\0')
+    {
+        error("error: cannot upgrade, the executable is unknown\n");
+        return;
+    }
+    // Stop reading at a frame boundary, the new process reads what follows
+    pipeline_stop();
+    for (int i = 0; i < input_device_count; i++)
+    {
+        stop_reader(&input_devices[i]);
+    }
+    emit_flush();
+    print_statistics();
+    upgrade(executable_path);
+    // Still here, keep running with the devices
+    attach_input();
+}
+
+/**
+ * Stops watching and releases the input devices that disconnected.
+ * The keys they held are released, the output device and the other devices are left as they are.
+ * */
+static void detach_lost_inputs()
+{
+    pipeline_stop();
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        if (!device->disconnected)
+        {
+            continue;
+        }
+        log("info: disconnected: %s (%s)\n", device->name, device->selection.event_path);
+        statistics.input_disconnects++;
+        stop_reader(device);
+        device->disconnected = 0;
+        release_device_keys(device);
+        // Keys released while the device was gone will never arrive
+        mapper = &device->mapper;
+        resetMapper();
+        release_input(device);
+    }
+    attach_input();
+}
+
+/**
+ * Captures the configured input devices that are not captured yet, after an event node appeared.
+ * */
+static void reconnect_inputs()
+{
+    int reconnected = 0;
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        if (device->file_descriptor >= 0 || device->selection.configuration[0] == '\0')
+        {
+            continue;
+        }
+        if (locate_device(&device->selection) != EXIT_SUCCESS)
+        {
+            continue;
+        }
+        if (bind_input(device, on_input_grabbed) != EXIT_SUCCESS)
+        {
+            release_input(device);
+            continue;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        device->reconnected = now.tv_sec * 1000000000L + now.tv_nsec;
+        statistics.input_reconnects++;
+        reconnected = 1;
+    }
+    if (reconnected)
+    {
+        if (update_output() != EXIT_SUCCESS)
+        {
+            exit_status = EXIT_FAILURE;
+            __atomic_store_n(&should_exit, 1, __ATOMIC_RELEASE);
+            return;
+        }
+        attach_input();
     }
-    return EXIT_SUCCESS;
 }
 
 /**
@@ -171,23 +650,263 @@ static int release_configuration_file_watch()
  * */
 static void clean_up()
 {
+    print_statistics();
     release_configuration_file_watch();
-    release_input();
+    detach_input();
+    engine_release();
+    emit_detach_output();
     release_output();
+    reactor_release();
 }
 
 /**
- * Main method.
+ * Checks if an input frame can be written as it came: it ends with a SYN_REPORT,
+ * and every event is passed through or a key the idle mapper passes through.
+ *
+ * @param keys Receives the number of keys in the frame.
+ * */
+static int is_passthrough_frame(struct input_device* device, struct input_event* events, int count, int* keys)
+{
+    if (device->reconnected != 0 || events[count - 1].type != EV_SYN || events[count - 1].code != SYN_REPORT)
+    {
+        return 0;
+    }
+    *keys = 0;
+    for (int i = 0; i < count - 1; i++)
+    {
+        struct input_event* event = &events[i];
+        if (event->type == EV_KEY)
+        {
+            if (event->value < 0 || event->value > 2 || !isPassthrough(event->code))
+            {
+                return 0;
+            }
+            (*keys)++;
+        }
+        else if (event->type == EV_SYN || !output_supports_event_type(event->type))
+        {
+            return 0;
+        }
+    }
+    // Each key is written in its own frame if configured
+    return !configuration->output_frame_per_key || *keys <= 1;
+}
+
+/**
+ * Processes one input frame, a run of events terminated by SYN_REPORT.
+ * The events that pass through are staged into the output frame, which ends with a single SYN_REPORT.
+ *
+ * @param device The input device.
+ * @param events The frame events.
+ * @param count The number of events in the frame.
+ * */
+static void process_frame(struct input_device* device, struct input_event* events, int count)
+{
+    statistics.input_frames++;
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].type == EV_SYN && events[i].code == SYN_DROPPED)
+        {
+            // The kernel dropped events, the frame is incomplete and is not forwarded
+            warn("warning: input events from %s were dropped, resynchronizing the held keys\n", device->name);
+            statistics.input_drops++;
+            reconcile_device_keys(device);
+            return;
+        }
+    }
+    mapper = &device->mapper;
+    emit_source(device);
+    emit_timestamp(&events[count - 1].time);
+    int keys = 0;
+    if (is_passthrough_frame(device, events, count, &keys))
+    {
+        statistics.passthrough_frames++;
+        emit_frame(events, count);
+        if (keys && device->scancodes_masked)
+        {
+            statistics.masked_events++;
+        }
+        emit_flush();
+        return;
+    }
+    keys = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct input_event* event = &events[i];
+        // We only want to manipulate key presses
+        if (event->type == EV_KEY
+            && (event->value == 0 || event->value == 1 || event->value == 2))
+        {
+            processKey(event->type, event->code, event->value);
+            keys = 1;
+            if (device->reconnected != 0)
+            {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long elapsed = now.tv_sec * 1000000000L + now.tv_nsec - device->reconnected;
+                log("info: first key from %s %.1f ms after reconnecting\n", device->name, elapsed / 1000000.0);
+                device->reconnected = 0;
+            }
+        }
+        else if (!output_supports_event_type(event->type))
+        {
+            // The kernel could not filter it
+            statistics.filtered_events++;
+        }
+        else if (event->type == EV_SYN && event->code == SYN_REPORT)
+        {
+            continue;
+        }
+        else
+        {
+            emit(event->type, event->code, event->value);
+        }
+    }
+    // Every key frame of a scancode reporting device carries one MSC_SCAN event
+    if (keys && device->scancodes_masked)
+    {
+        statistics.masked_events++;
+    }
+    emit_flush();
+}
+
+/**
+ * Splits the buffered input events into frames and processes each complete frame.
+ *
+ * @param device The input device.
+ * @param events The buffered events.
+ * @param count The number of buffered events.
+ * @param capacity The capacity of the buffer, in events.
+ * @return int The number of events consumed.
+ * @remarks
+ * A trailing partial frame is left in the buffer to be completed by the next read,
+ * unless the buffer is full, in which case it is processed as is.
+ * */
+static int process_frames(struct input_device* device, struct input_event* events, int count, int capacity)
+{
+    int start = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].type == EV_SYN && events[i].code == SYN_REPORT)
+        {
+            process_frame(device, &events[start], i - start + 1);
+            start = i + 1;
+        }
+    }
+    if (start == 0 && count == capacity)
+    {
+        process_frame(device, events, count);
+        start = count;
+    }
+    return start;
+}
+
+/**
+ * Returns the free part of the input buffer of the device.
+ * */
+static void* next_input_buffer(struct reader* reader, size_t* length)
+{
+    struct input_device* device = (struct input_device*)reader;
+    *length = sizeof(device->buffer) - device->buffer_bytes;
+    return (char*)device->buffer + device->buffer_bytes;
+}
+
+/**
+ * Marks the input device as disconnected, to be released by the event loop.
+ * Called from the reader thread in pipeline mode.
+ * */
+static void lose_input(struct input_device* device)
+{
+    device->disconnected = 1;
+    device->reader.stopping = 1;
+    __atomic_store_n(&input_lost, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Processes every complete frame after a read from the input device.
  *
  * @remarks
  * read: Read NBYTES into BUF from FD. Return the number read, -1 for errors or 0 for EOF.
- * EOF doesn't make sense here. Partial events will be ignored.
+ * ENODEV is returned once the device is unplugged or lost over suspend, EOF doesn't make sense here.
+ * Partial events are kept in the buffer until the rest arrives.
+ * */
+static void on_input_read(struct reader* reader, ssize_t result)
+{
+    struct input_device* device = (struct input_device*)reader;
+    if (result == (ssize_t)-1)
+    {
+        if (errno == EINTR || errno == EAGAIN)
+        {
+            return;
+        }
+        if (errno == ENODEV)
+        {
+            lose_input(device);
+            return;
+        }
+        error("error: unable to read input event: %s\n", strerror(errno));
+        exit_status = EXIT_FAILURE;
+        __atomic_store_n(&should_exit, 1, __ATOMIC_RELEASE);
+        if (pipeline_active)
+        {
+            // The reader thread polls the device itself, it stops and wakes the event loop
+            reader->stopping = 1;
+        }
+        else
+        {
+            engine_stop_reader(reader);
+        }
+        return;
+    }
+    if (result == (ssize_t)0)
+    {
+        warn("warning: received EOF while reading input events\n");
+        lose_input(device);
+        return;
+    }
+    int previous = device->buffer_bytes / sizeof(struct input_event);
+    device->buffer_bytes += result;
+    int count = device->buffer_bytes / sizeof(struct input_event);
+    if (device->buffer_bytes % sizeof(struct input_event) != 0)
+    {
+        warn("warning: partial input event received\n");
+    }
+    statistics.input_reads++;
+    statistics.input_events += count - previous;
+    int consumed = process_frames(device, device->buffer, count, INPUT_BUFFER_EVENTS);
+    if (consumed > 0)
+    {
+        device->buffer_bytes -= consumed * sizeof(struct input_event);
+        memmove(device->buffer, device->buffer + consumed, device->buffer_bytes);
+    }
+}
+
+/**
+ * Main method.
+ *
+ * @remarks
+ * A single epoll loop multiplexes the input devices, the configuration file watch and signals.
+ * With the io_uring engine, input reads stay posted on the ring and the epoll descriptor is polled through it.
  * https://docs.kernel.org/input/uinput.html
  * https://stackoverflow.com/questions/20943322/accessing-keys-from-linux-input-device
  * */
 int main(int argc, char* argv[])
 {
-    main_thread_identifier = pthread_self();
+    if (argc > 1 && strcmp(argv[1], "--probe-keybits") == 0)
+    {
+        return probe_keybits();
+    }
+    // An upgrading process hands over its devices and state through a descriptor
+    int state_descriptor = -1;
+    if (argc > 2 && strcmp(argv[1], "--resume") == 0)
+    {
+        state_descriptor = atoi(argv[2]);
+    }
+    find_executable();
+    if (reactor_initialize() != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
     if (attach_signal_handlers() != EXIT_SUCCESS)
     {
         error("error: failed to attach signal handlers\n");
@@ -198,96 +917,102 @@ int main(int argc, char* argv[])
         error("error: could not find the configuration file\n");
         return EXIT_FAILURE;
     }
-    if (read_configuration() != EXIT_SUCCESS)
+    struct configuration* loaded = load_configuration();
+    if (loaded == NULL)
     {
         error("error: failed to read the configuration\n");
         return EXIT_FAILURE;
     }
+    activate_configuration(loaded);
+    int resumed = state_descriptor >= 0 && resume(state_descriptor) == EXIT_SUCCESS;
+    if (resumed)
+    {
+        adopt_unused_selections();
+    }
+    else
+    {
+        select_input_devices();
+    }
+    engine_initialize(configuration->performance_engine);
+    engine_set_busy_poll(configuration->performance_busy_poll);
+    apply_performance_profile();
+    warm_up();
     if (watch_configuration_file() != EXIT_SUCCESS)
     {
         error("error: failed to watch the configuration file\n");
         return EXIT_FAILURE;
     }
-    if (bind_input() != EXIT_SUCCESS)
+    bind_inputs();
+    if (!resumed && bind_output() != EXIT_SUCCESS)
     {
-        error("error: could not capture the input device\n");
+        error("error: could not create the virtual output device\n");
+        return EXIT_FAILURE;
     }
-    if (bind_output() != EXIT_SUCCESS)
+    if (resumed && update_output() != EXIT_SUCCESS)
     {
-        error("error: could not create the virtual output device\n");
+        clean_up();
         return EXIT_FAILURE;
     }
+    // LED changes sent to the output device are forwarded to the input devices
+    emit_attach_output();
+    attach_input();
     log("info: running\n");
-    // Read events
-    struct input_event event;
-    ssize_t result;
     while (1)
     {
-        if (should_reload)
+        if (configuration_loaded)
         {
-            log("info: reloading\n");
-            release_output_keys();
-            release_input();
-            if (read_configuration() != EXIT_SUCCESS)
+            configuration_loaded = 0;
+            configuration_loading = 0;
+            if (pending_configuration == NULL)
             {
-                error("error: failed to read the configuration\n");
-                clean_up();
-                return EXIT_FAILURE;
+                error("error: failed to read the configuration, keeping the running configuration\n");
             }
-            if (bind_input() != EXIT_SUCCESS)
+            else if (adopt_configuration(pending_configuration) != EXIT_SUCCESS)
             {
-                error("error: could not capture the keyboard device\n");
+                clean_up();
+                return EXIT_FAILURE;
             }
-            should_reload = 0;
+            pending_configuration = NULL;
         }
-        if (should_exit)
+        // After a finished load, so a change made while it was in flight starts the next one before waiting
+        if (should_reload && !configuration_loading)
         {
-            log("info: exiting\n");
-            clean_up();
-            return EXIT_SUCCESS;
+            should_reload = 0;
+            log("info: reloading\n");
+            statistics.reloads++;
+            // The file is read and compiled on the loader thread, the input keeps flowing meanwhile
+            configuration_loading = load_configuration_async(on_configuration_loaded) == EXIT_SUCCESS;
         }
-        if (input_event_path[0] == '\0')
+        if (should_upgrade)
         {
-            log("info: you may update the configuration file to have the application attempt discovering the input device again.\n");
-            sleep(UINT_MAX); // this can be interrupted
-            continue;
+            should_upgrade = 0;
+            upgrade_executable();
         }
-        result = read(input_file_descriptor, &event, sizeof(event));
-        if (result == (ssize_t)-1)
+        // Set by the reader thread in pipeline mode
+        if (__atomic_exchange_n(&input_lost, 0, __ATOMIC_ACQ_REL))
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            else
-            {
-                error("error: unable to read input event: %s\n", strerror(errno));
-                log("info: exiting\n");
-                clean_up();
-                return EXIT_FAILURE;
-            }
+            detach_lost_inputs();
         }
-        if (result == (ssize_t)0)
+        if (input_grabbed)
         {
-            error("error: received EOF while reading input events\n");
-            log("info: exiting\n");
-            clean_up();
-            return EXIT_FAILURE;
+            input_grabbed = 0;
+            attach_input();
         }
-        if (result != sizeof(event))
+        if (should_reconnect)
         {
-            warn("warning: partial input event received\n");
-            continue;
+            should_reconnect = 0;
+            reconnect_inputs();
         }
-        // We only want to manipulate key presses
-        if (event.type == EV_KEY
-            && (event.value == 0 || event.value == 1 || event.value == 2))
+        if (__atomic_load_n(&should_exit, __ATOMIC_ACQUIRE))
         {
-            processKey(event.type, event.code, event.value);
+            log("info: exiting\n");
+            clean_up();
+            return exit_status;
         }
-        else
+        if (engine_wait(-1) < 0)
         {
-            emit(event.type, event.code, event.value);
+            clean_up();
+            return EXIT_FAILURE;
         }
     }
 }
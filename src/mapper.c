@@ -8,18 +8,26 @@
 #include "mapper.h"
 #include "queue.h"
 
-// The state machine state
-enum states state = idle;
+// The mapper state of the default device
+static struct mapper_state default_mapper = { idle, 0, { { 0 }, 0, 0 }, NULL };
 
-// Flag if the hyper key has been emitted
-static int hyperEmitted;
+// The mapper state used by processKey
+struct mapper_state* mapper = &default_mapper;
 
 /**
  * Checks if the key is the hyper key.
  * */
 static int isHyper(int code)
 {
-    return code == hyperKey;
+    return code == configuration->hyperKey;
+}
+
+/**
+ * Returns the bindings of the device, or the global bindings.
+ * */
+static struct key_output* device_bindings()
+{
+    return mapper->keymap != NULL ? mapper->keymap : configuration->keymap;
 }
 
 /**
@@ -27,7 +35,7 @@ static int isHyper(int code)
  * */
 static int isMapped(int code)
 {
-    return keymap[code].sequence[0] != 0;
+    return code < 256 && device_bindings()[code].sequence[0] != 0;
 }
 
 /**
@@ -35,15 +43,8 @@ static int isMapped(int code)
  * */
 static void send_mapped_key(int code, int value)
 {
-    struct key_output output = keymap[code];
-    for (int i = 0; i < MAX_SEQUENCE; i++)
-    {
-        if (output.sequence[i] == 0)
-        {
-            break;
-        }
-        emit(EV_KEY, output.sequence[i], value);
-    }
+    struct key_output* output = &device_bindings()[code];
+    emit_frame(output->frames[value], output->frame_length);
 }
 
 /**
@@ -51,10 +52,10 @@ static void send_mapped_key(int code, int value)
  * */
 static void send_mapped_queue(int value)
 {
-    int length = lengthOfQueue();
+    int length = lengthOfQueue(&mapper->queue);
     for (int i = 0; i < length; i++)
     {
-        send_mapped_key(dequeue(), value);
+        send_mapped_key(dequeue(&mapper->queue), value);
     }
 }
 
@@ -63,9 +64,9 @@ static void send_mapped_queue(int value)
  * */
 static void send_remapped_key(int code, int value)
 {
-    if (remap[code] != 0)
+    if (code < 256 && configuration->remap[code] != 0)
     {
-        code = remap[code];
+        code = configuration->remap[code];
     }
     emit(EV_KEY, code, value);
 }
@@ -75,10 +76,67 @@ static void send_remapped_key(int code, int value)
  * */
 static void send_remapped_queue(int value)
 {
-    int length = lengthOfQueue();
+    int length = lengthOfQueue(&mapper->queue);
     for (int i = 0; i < length; i++)
     {
-        send_remapped_key(dequeue(), value);
+        send_remapped_key(dequeue(&mapper->queue), value);
+    }
+}
+
+/**
+ * Initializes a mapper state.
+ * */
+void initializeMapper(struct mapper_state* state, struct key_output* bindings)
+{
+    state->state = idle;
+    state->hyperEmitted = 0;
+    clearQueue(&state->queue);
+    state->keymap = bindings;
+}
+
+/**
+ * Returns the state machine to idle and clears the queue.
+ * */
+void resetMapper()
+{
+    mapper->state = idle;
+    mapper->hyperEmitted = 0;
+    clearQueue(&mapper->queue);
+}
+
+/**
+ * Checks if a key would be written as it came, in the idle state.
+ * */
+int isPassthrough(int code)
+{
+    return mapper->state == idle && code < KEY_CNT && configuration->key_actions[code] == key_action_pass;
+}
+
+/**
+ * Seeds the mapper with a key that was already held when the device was captured.
+ * A held hyper key enters the hyper state as if the hyper key was emitted, so releasing it types nothing.
+ * Other keys are pressed on the output device if press is set, their release passes through as usual.
+ * Keys bound to the held hyper key are pressed as their mapped output if mapped is set. Otherwise
+ * they are not pressed, their release is dropped by the output device.
+ * */
+void seedKey(int code, int press, int mapped)
+{
+    if (isHyper(code))
+    {
+        mapper->state = hyper;
+        mapper->hyperEmitted = 1;
+        clearQueue(&mapper->queue);
+    }
+    else if (press && (mapper->state == idle || !isMapped(code)))
+    {
+        send_remapped_key(code, 1);
+    }
+    else if (press && mapped)
+    {
+        // As if the key was pressed while the hyper key was held
+        mapper->state = map;
+        enqueue(&mapper->queue, code);
+        send_mapped_key(code, 1);
     }
 }
 
@@ -87,16 +145,22 @@ static void send_remapped_queue(int value)
  * */
 void processKey(int type, int code, int value)
 {
-    /* printf("processKey(in): code=%i value=%i state=%i\n", code, value, state); */
-    switch (state)
+    /* printf("processKey(in): code=%i value=%i state=%i\n", code, value, mapper->state); */
+    // Idle keys that are neither remapped nor the hyper key are written as they came
+    if (isPassthrough(code))
+    {
+        emit(EV_KEY, code, value);
+        return;
+    }
+    switch (mapper->state)
     {
         case idle: // 0
         {
             if (isHyper(code) && isDown(value))
             {
-                state = hyper;
-                hyperEmitted = 0;
-                clearQueue();
+                mapper->state = hyper;
+                mapper->hyperEmitted = 0;
+                clearQueue(&mapper->queue);
             }
             else
             {
@@ -110,8 +174,8 @@ void processKey(int type, int code, int value)
             {
                 if (!isDown(value))
                 {
-                    state = idle;
-                    if (!hyperEmitted)
+                    mapper->state = idle;
+                    if (!mapper->hyperEmitted)
                     {
                         send_remapped_key(code, 1);
                     }
@@ -122,8 +186,8 @@ void processKey(int type, int code, int value)
             {
                 if (isDown(value))
                 {
-                    state = delay;
-                    enqueue(code);
+                    mapper->state = delay;
+                    enqueue(&mapper->queue, code);
                 }
                 else
                 {
@@ -134,10 +198,10 @@ void processKey(int type, int code, int value)
             {
                 if (!isModifier(code) && isDown(value))
                 {
-                    if (!hyperEmitted)
+                    if (!mapper->hyperEmitted)
                     {
-                        send_remapped_key(hyperKey, 1);
-                        hyperEmitted = 1;
+                        send_remapped_key(configuration->hyperKey, 1);
+                        mapper->hyperEmitted = 1;
                     }
                 }
                 send_remapped_key(code, value);
@@ -150,25 +214,25 @@ void processKey(int type, int code, int value)
             {
                 if (!isDown(value))
                 {
-                    state = idle;
-                    if (!hyperEmitted)
+                    mapper->state = idle;
+                    if (!mapper->hyperEmitted)
                     {
-                        send_remapped_key(hyperKey, 1);
+                        send_remapped_key(configuration->hyperKey, 1);
                     }
                     send_remapped_queue(1);
-                    send_remapped_key(hyperKey, 0);
+                    send_remapped_key(configuration->hyperKey, 0);
                 }
             }
             else if (isMapped(code))
             {
-                state = map;
+                mapper->state = map;
                 if (isDown(value))
                 {
-                    if (lengthOfQueue() != 0)
+                    if (lengthOfQueue(&mapper->queue) != 0)
                     {
-                        send_mapped_key(peek(), 1);
+                        send_mapped_key(peek(&mapper->queue), 1);
                     }
-                    enqueue(code);
+                    enqueue(&mapper->queue, code);
                     send_mapped_key(code, value);
                 }
                 else
@@ -179,7 +243,7 @@ void processKey(int type, int code, int value)
             }
             else
             {
-                state = map;
+                mapper->state = map;
                 send_remapped_key(code, value);
             }
             break;
@@ -190,7 +254,7 @@ void processKey(int type, int code, int value)
             {
                 if (!isDown(value))
                 {
-                    state = idle;
+                    mapper->state = idle;
                     send_mapped_queue(0);
                 }
             }
@@ -198,7 +262,7 @@ void processKey(int type, int code, int value)
             {
                 if (isDown(value))
                 {
-                    enqueue(code);
+                    enqueue(&mapper->queue, code);
                 }
                 send_mapped_key(code, value);
             }
@@ -209,5 +273,5 @@ void processKey(int type, int code, int value)
             break;
         }
     }
-    /* printf("processKey(out): state=%i\n", state); */
+    /* printf("processKey(out): state=%i\n", mapper->state); */
 }
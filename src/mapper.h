@@ -1,6 +1,9 @@
 #ifndef mapper_h
 #define mapper_h
 
+#include "config.h"
+#include "queue.h"
+
 // The state machine states
 enum states
 {
@@ -10,7 +13,50 @@ enum states
     map
 };
 
-extern enum states state;
+/**
+ * The state of the mapper for one input device.
+ * */
+struct mapper_state
+{
+    // The state machine state
+    enum states state;
+    // Flag if the hyper key has been emitted
+    int hyperEmitted;
+    // The mapped keys that are held
+    struct queue queue;
+    // The bindings of the device, or NULL to use the global bindings
+    struct key_output* keymap;
+};
+
+/**
+ * The mapper state used by processKey.
+ * */
+extern struct mapper_state* mapper;
+
+/**
+ * Initializes a mapper state, with the bindings of the device or NULL for the global bindings.
+ * */
+void initializeMapper(struct mapper_state* state, struct key_output* bindings);
+
+/**
+ * Returns the state machine to idle and clears the queue.
+ * */
+void resetMapper();
+
+/**
+ * Checks if a key would be written as it came, which is true for the keys of the idle state
+ * that are neither remapped nor the hyper key.
+ * */
+int isPassthrough(int code);
+
+/**
+ * Seeds the mapper with a key that was already held when the device was captured.
+ * A held hyper key enters the hyper state as if the hyper key was emitted, so releasing it types nothing.
+ * Other keys are pressed on the output device if press is set, their release passes through as usual.
+ * Keys bound to the held hyper key are pressed as their mapped output if mapped is set. Otherwise
+ * they are not pressed, their release is dropped by the output device.
+ * */
+void seedKey(int code, int press, int mapped);
 
 /**
  * Processes a key input event. Converts and emits events as necessary.
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/input.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "buffers.h"
+#include "config.h"
+#include "emit.h"
+#include "mapper.h"
+#include "performance.h"
+
+/**
+ * The amount of stack touched after locking memory, in bytes.
+ * */
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+/**
+ * The number of synthetic keystroke sequences run by the warm-up.
+ * */
+#define WARM_UP_PASSES 64
+
+// Set once memory has been locked, mlockall(MCL_FUTURE) covers later allocations
+static int memory_locked = 0;
+
+/**
+ * Touches the stack so its pages are resident before they are needed.
+ * */
+static void __attribute__((noinline)) prefault_stack()
+{
+    volatile char stack[PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+    {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * Sets the SCHED_FIFO priority.
+ * */
+static void apply_priority()
+{
+    struct sched_param parameters;
+    memset(&parameters, 0, sizeof(parameters));
+    parameters.sched_priority = configuration->performance_priority;
+    int policy = configuration->performance_priority > 0 ? SCHED_FIFO : SCHED_OTHER;
+    if (sched_setscheduler(0, policy, &parameters) < 0)
+    {
+        if (configuration->performance_priority > 0)
+        {
+            error("error: could not set the SCHED_FIFO priority %i: %s (requires CAP_SYS_NICE or RLIMIT_RTPRIO)\n", configuration->performance_priority, strerror(errno));
+        }
+        return;
+    }
+    if (configuration->performance_priority > 0)
+    {
+        log("info: running with SCHED_FIFO priority %i\n", configuration->performance_priority);
+    }
+}
+
+/**
+ * Pins the process to the configured CPUs, a comma separated list of CPU numbers and ranges.
+ * */
+static void apply_affinity()
+{
+    if (configuration->performance_affinity[0] == '\0')
+    {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    char list[sizeof(configuration->performance_affinity)];
+    strcpy(list, configuration->performance_affinity);
+    char* tokens = list;
+    char* token;
+    while ((token = strsep(&tokens, ",")) != NULL)
+    {
+        char* end;
+        long first = strtol(token, &end, 10);
+        long last = first;
+        if (*end == '-')
+        {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (end == token || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+        {
+            error("error: invalid CPU in the affinity list: %s\n", token);
+            return;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+    {
+        error("error: could not set the CPU affinity to %s: %s\n", configuration->performance_affinity, strerror(errno));
+        return;
+    }
+    log("info: running on CPUs %s\n", configuration->performance_affinity);
+}
+
+/**
+ * Locks current and future memory and prefaults the stack.
+ * */
+static void apply_memory_lock()
+{
+    if (!configuration->performance_lock_memory || memory_locked)
+    {
+        return;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        error("error: could not lock memory: %s (requires CAP_IPC_LOCK or a larger RLIMIT_MEMLOCK)\n", strerror(errno));
+        return;
+    }
+    prefault_stack();
+    memory_locked = 1;
+    log("info: memory locked\n");
+}
+
+/**
+ * Applies the scheduling priority, CPU affinity and memory locking from the configuration.
+ * Each setting that cannot be applied is logged and skipped.
+ * */
+void apply_performance_profile()
+{
+    apply_priority();
+    apply_affinity();
+    apply_memory_lock();
+}
+
+/**
+ * Runs synthetic key events through the mapper into a discarding output,
+ * so the first real keystroke does not pay for page faults and cold caches.
+ * */
+void warm_up()
+{
+    if (!configuration->performance_warm_up)
+    {
+        return;
+    }
+    // Use a bound key if there is one, so the mapped path is exercised too
+    int mapped = KEY_J;
+    for (int code = 1; code < 256; code++)
+    {
+        if (configuration->keymap[code].sequence[0] != 0 && code != configuration->hyperKey)
+        {
+            mapped = code;
+            break;
+        }
+    }
+    emit_discard(1);
+    for (int i = 0; i < WARM_UP_PASSES; i++)
+    {
+        processKey(EV_KEY, KEY_A, 1);
+        emit_flush();
+        processKey(EV_KEY, KEY_A, 0);
+        emit_flush();
+        processKey(EV_KEY, configuration->hyperKey, 1);
+        processKey(EV_KEY, mapped, 1);
+        emit_flush();
+        processKey(EV_KEY, mapped, 2);
+        emit_flush();
+        processKey(EV_KEY, mapped, 0);
+        emit_flush();
+        processKey(EV_KEY, configuration->hyperKey, 0);
+        emit_flush();
+    }
+    emit_discard(0);
+    resetMapper();
+    log("info: warmed up the key processing path\n");
+}
@@ -0,0 +1,16 @@
+#ifndef performance_h
+#define performance_h
+
+/**
+ * Applies the scheduling priority, CPU affinity and memory locking from the configuration.
+ * Each setting that cannot be applied is logged and skipped.
+ * */
+void apply_performance_profile();
+
+/**
+ * Runs synthetic key events through the mapper into a discarding output,
+ * so the first real keystroke does not pay for page faults and cold caches.
+ * */
+void warm_up();
+
+#endif
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binding.h"
+#include "buffers.h"
+#include "pipeline.h"
+#include "reactor.h"
+#include "statistics.h"
+
+/**
+ * The number of frames the ring holds. Must be a power of two.
+ * */
+#define RING_FRAMES 256
+/**
+ * The number of events a ring frame holds.
+ * */
+#define RING_FRAME_EVENTS 64
+/**
+ * The number of events the writer thread writes at once.
+ * */
+#define WRITE_BATCH_EVENTS 256
+
+struct ring_frame
+{
+    // When the frame was pushed, in nanoseconds
+    long pushed;
+    int count;
+    struct input_event events[RING_FRAME_EVENTS];
+};
+
+// The ring, written by the reader thread and read by the writer thread
+static struct ring_frame ring[RING_FRAMES];
+static unsigned long ring_head = 0;
+static unsigned long ring_tail = 0;
+// Set while the writer thread is about to sleep, so the reader knows to wake it
+static int writer_sleeping = 0;
+static int writer_wake = -1;
+static int writer_stopping = 0;
+
+// The reader thread
+static struct reader** input_readers = NULL;
+static int input_reader_count = 0;
+static int reader_stop = -1;
+
+// Wakes the event loop when the reader thread stops on its own
+static void on_reader_stopped(struct watcher* watcher, uint32_t events);
+static struct watcher stopped_watcher = { -1, on_reader_stopped };
+
+static pthread_t reader_thread;
+static pthread_t writer_thread;
+
+int pipeline_active = 0;
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ * */
+static long monotonic_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Wakes the writer thread if it is sleeping.
+ * */
+static void wake_writer()
+{
+    if (__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST))
+    {
+        uint64_t one = 1;
+        if (write(writer_wake, &one, sizeof(one)) < 0)
+        {
+            error("error: failed to wake the writer thread: %s\n", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Passes an output frame from the reader thread to the writer thread.
+ * Waits for room if the ring is full.
+ * */
+void pipeline_push(const struct input_event* events, int count, const struct timeval* input_time, int clock)
+{
+    while (count > 0)
+    {
+        unsigned long tail = ring_tail;
+        while (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) >= RING_FRAMES)
+        {
+            statistics.pipeline_full_waits++;
+            wake_writer();
+            sched_yield();
+        }
+        struct ring_frame* frame = &ring[tail & (RING_FRAMES - 1)];
+        frame->count = count < RING_FRAME_EVENTS ? count : RING_FRAME_EVENTS;
+        memcpy(frame->events, events, frame->count * sizeof(struct input_event));
+        frame->pushed = monotonic_time();
+        events += frame->count;
+        count -= frame->count;
+        __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+        unsigned long occupancy = tail + 1 - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        if (occupancy > statistics.pipeline_occupancy_maximum)
+        {
+            statistics.pipeline_occupancy_maximum = occupancy;
+        }
+    }
+    wake_writer();
+    // The reader stage, from the input frame to the ring
+    if (input_time != NULL)
+    {
+        struct timespec now;
+        clock_gettime(clock, &now);
+        long latency = (now.tv_sec - input_time->tv_sec) * 1000000L + (now.tv_nsec / 1000 - input_time->tv_usec);
+        if (latency >= 0)
+        {
+            statistics.pipeline_reader_frames++;
+            statistics.pipeline_reader_latency_total += latency;
+            if (latency > (long)statistics.pipeline_reader_latency_maximum)
+            {
+                statistics.pipeline_reader_latency_maximum = latency;
+            }
+        }
+    }
+}
+
+/**
+ * Writes a batch of events, waiting for the output device to accept them.
+ * */
+static void write_batch(struct input_event* events, int count)
+{
+    size_t length = count * sizeof(struct input_event);
+    char* buffer = (char*)events;
+    while (length > 0)
+    {
+        ssize_t result = write(output_file_descriptor, buffer, length);
+        statistics.output_writes++;
+        if (result < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                struct pollfd writable = { output_file_descriptor, POLLOUT, 0 };
+                poll(&writable, 1, -1);
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("error: unable to write output events: %s\n", strerror(errno));
+            statistics.output_dropped_events += length / sizeof(struct input_event);
+            return;
+        }
+        buffer += result;
+        length -= result;
+    }
+}
+
+/**
+ * Drains the ring to the output device in batches.
+ * */
+static void* run_writer(void* argument)
+{
+    static struct input_event batch[WRITE_BATCH_EVENTS];
+    while (1)
+    {
+        unsigned long head = ring_head;
+        unsigned long tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            if (__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+            // Announce the sleep, then check again so a push in between is not missed
+            __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+            if (head == __atomic_load_n(&ring_tail, __ATOMIC_SEQ_CST) && !__atomic_load_n(&writer_stopping, __ATOMIC_SEQ_CST))
+            {
+                uint64_t count;
+                if (read(writer_wake, &count, sizeof(count)) < 0 && errno != EINTR)
+                {
+                    error("error: the writer thread failed to wait: %s\n", strerror(errno));
+                }
+            }
+            __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        statistics.pipeline_occupancy_total += tail - head;
+        statistics.pipeline_drains++;
+        int count = 0;
+        int frames = 0;
+        long now = monotonic_time();
+        while (head != tail)
+        {
+            struct ring_frame* frame = &ring[head & (RING_FRAMES - 1)];
+            if (count + frame->count > WRITE_BATCH_EVENTS)
+            {
+                break;
+            }
+            memcpy(&batch[count], frame->events, frame->count * sizeof(struct input_event));
+            count += frame->count;
+            long latency = (now - frame->pushed) / 1000;
+            statistics.pipeline_ring_latency_total += latency;
+            if (latency > (long)statistics.pipeline_ring_latency_maximum)
+            {
+                statistics.pipeline_ring_latency_maximum = latency;
+            }
+            statistics.pipeline_frames++;
+            frames++;
+            head++;
+        }
+        // Release the slots before the write, the frames were copied
+        __atomic_store_n(&ring_head, head, __ATOMIC_RELEASE);
+        write_batch(batch, count);
+        statistics.output_events += count;
+        // The writer stage, from the ring to the output device, the same for every frame of the batch
+        long latency = (monotonic_time() - now) / 1000;
+        statistics.pipeline_writer_latency_total += latency * frames;
+        if (latency > (long)statistics.pipeline_writer_latency_maximum)
+        {
+            statistics.pipeline_writer_latency_maximum = latency;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reads the input devices and runs the mapper until stopped.
+ * */
+static void* run_reader(void* argument)
+{
+    struct pollfd descriptors[MAX_INPUT_DEVICES + 1];
+    for (int i = 0; i < input_reader_count; i++)
+    {
+        descriptors[i] = (struct pollfd){ input_readers[i]->watcher.file_descriptor, POLLIN, 0 };
+    }
+    descriptors[input_reader_count] = (struct pollfd){ reader_stop, POLLIN, 0 };
+    int stopping = 0;
+    while (!stopping)
+    {
+        if (poll(descriptors, input_reader_count + 1, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("error: the reader thread failed to wait: %s\n", strerror(errno));
+            break;
+        }
+        if (descriptors[input_reader_count].revents)
+        {
+            break;
+        }
+        for (int i = 0; i < input_reader_count && !stopping; i++)
+        {
+            struct reader* reader = input_readers[i];
+            if (!descriptors[i].revents)
+            {
+                continue;
+            }
+            size_t length;
+            void* buffer = reader->next_buffer(reader, &length);
+            ssize_t result = read(reader->watcher.file_descriptor, buffer, length);
+            statistics.pipeline_syscalls++;
+            if (result < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                continue;
+            }
+            reader->on_read(reader, result);
+            stopping = reader->stopping;
+        }
+    }
+    if (stopping)
+    {
+        // Stopped by the reader callback, let the event loop notice
+        uint64_t one = 1;
+        if (write(stopped_watcher.file_descriptor, &one, sizeof(one)) < 0)
+        {
+            error("error: failed to wake the event loop: %s\n", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Clears the wake-up of the event loop.
+ * */
+static void on_reader_stopped(struct watcher* watcher, uint32_t events)
+{
+    uint64_t count;
+    if (read(watcher->file_descriptor, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        error("error: failed to read the pipeline event: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Closes the pipeline file descriptors.
+ * */
+static void close_descriptors()
+{
+    if (writer_wake >= 0) close(writer_wake);
+    if (reader_stop >= 0) close(reader_stop);
+    if (stopped_watcher.file_descriptor >= 0)
+    {
+        reactor_remove(&stopped_watcher);
+        close(stopped_watcher.file_descriptor);
+    }
+    writer_wake = -1;
+    reader_stop = -1;
+    stopped_watcher.file_descriptor = -1;
+}
+
+/**
+ * Starts the pipeline: a reader thread that reads the input device and runs the mapper,
+ * and a writer thread that writes the mapped frames to the output device.
+ * The threads are connected by a lock-free single-producer/single-consumer ring.
+ *
+ * @param readers The input readers, called on the reader thread.
+ * @param count The number of readers, at most MAX_INPUT_DEVICES.
+ * */
+int pipeline_start(struct reader** readers, int count)
+{
+    input_readers = readers;
+    input_reader_count = count;
+    for (int i = 0; i < count; i++)
+    {
+        readers[i]->stopping = 0;
+    }
+    ring_head = 0;
+    ring_tail = 0;
+    writer_sleeping = 0;
+    writer_stopping = 0;
+    writer_wake = eventfd(0, EFD_CLOEXEC);
+    reader_stop = eventfd(0, EFD_CLOEXEC);
+    stopped_watcher.file_descriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (writer_wake < 0 || reader_stop < 0 || stopped_watcher.file_descriptor < 0)
+    {
+        error("error: failed to create the pipeline events: %s\n", strerror(errno));
+        close_descriptors();
+        return EXIT_FAILURE;
+    }
+    reactor_add(&stopped_watcher, EPOLLIN);
+    if (pthread_create(&writer_thread, NULL, run_writer, NULL) != 0)
+    {
+        error("error: failed to start the writer thread\n");
+        close_descriptors();
+        return EXIT_FAILURE;
+    }
+    pipeline_active = 1;
+    if (pthread_create(&reader_thread, NULL, run_reader, NULL) != 0)
+    {
+        error("error: failed to start the reader thread\n");
+        input_readers = NULL;
+        pipeline_stop();
+        return EXIT_FAILURE;
+    }
+    log("info: running the reader and writer threads\n");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Stops the reader thread, then lets the writer thread drain the ring and stops it.
+ * */
+void pipeline_stop()
+{
+    if (!pipeline_active)
+    {
+        return;
+    }
+    uint64_t one = 1;
+    if (input_readers != NULL && write(reader_stop, &one, sizeof(one)) >= 0)
+    {
+        pthread_join(reader_thread, NULL);
+    }
+    __atomic_store_n(&writer_stopping, 1, __ATOMIC_SEQ_CST);
+    if (write(writer_wake, &one, sizeof(one)) >= 0)
+    {
+        pthread_join(writer_thread, NULL);
+    }
+    pipeline_active = 0;
+    close_descriptors();
+}
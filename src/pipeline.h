@@ -0,0 +1,37 @@
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <linux/input.h>
+
+#include "engine.h"
+
+/**
+ * Set while the reader and writer threads are running.
+ * */
+extern int pipeline_active;
+
+/**
+ * Starts the pipeline: a reader thread that reads the input device and runs the mapper,
+ * and a writer thread that writes the mapped frames to the output device.
+ * The threads are connected by a lock-free single-producer/single-consumer ring.
+ *
+ * @param readers The input readers, called on the reader thread.
+ * @param count The number of readers, at most MAX_INPUT_DEVICES.
+ * */
+int pipeline_start(struct reader** readers, int count);
+
+/**
+ * Stops the reader thread, then lets the writer thread drain the ring and stops it.
+ * */
+void pipeline_stop();
+
+/**
+ * Passes an output frame from the reader thread to the writer thread.
+ * Waits for room if the ring is full.
+ *
+ * @param input_time The timestamp of the input frame, or NULL if the frame has none.
+ * @param clock The clock of the input timestamp.
+ * */
+void pipeline_push(const struct input_event* events, int count, const struct timeval* input_time, int clock);
+
+#endif
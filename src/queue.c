@@ -1,76 +1,71 @@
 #include "queue.h"
 
-#define length 8
-
-// The queue store
-static int store[length];
-
-// The queue indexes
-static int tail = 0;
-static int head = 0;
+#define length QUEUE_LENGTH
 
 /**
  * Clears the queue.
  * */
-void clearQueue()
+void clearQueue(struct queue* queue)
 {
     for (int i = 0; i < length; i++)
     {
-        store[i] = 0;
+        queue->store[i] = 0;
     }
+    queue->head = 0;
+    queue->tail = 0;
 }
 
 /**
  * Returns the current length of the queue.
  * */
-int lengthOfQueue()
+int lengthOfQueue(struct queue* queue)
 {
-    return ((tail + length) - head) % length;
+    return ((queue->tail + length) - queue->head) % length;
 }
 
 /**
  * Pushes the value on the queue, if the value does not already exist in the queue.
  * */
-void enqueue(int value)
+void enqueue(struct queue* queue, int value)
 {
-    for (int i = head; i != tail; i = (i + 1) % length)
+    for (int i = queue->head; i != queue->tail; i = (i + 1) % length)
     {
-        if (store[i] == value)
+        if (queue->store[i] == value)
         {
             return;
         }
     }
-    int index = (tail + 1) % length;
-    if (index == head)
+    int index = (queue->tail + 1) % length;
+    if (index == queue->head)
     {
         return;
     }
-    store[tail] = value;
-    tail = index;
+    queue->store[queue->tail] = value;
+    queue->tail = index;
 }
 
 /**
  * Removes the first value from the queue and returns it.
  * */
-int dequeue()
+int dequeue(struct queue* queue)
 {
-    if (head == tail)
+    if (queue->head == queue->tail)
     {
         return 0;
     }
-    int value = store[head];
-    head = (head + 1) % length;
+    int value = queue->store[queue->head];
+    queue->head = (queue->head + 1) % length;
     return value;
 }
 
 /**
  * Returns the first value in the queue without removing it.
  * */
-int peek()
+int peek(struct queue* queue)
 {
-    if (head == tail)
+    if (queue->head == queue->tail)
     {
         return 0;
     }
-    return store[head];
+    return queue->store[queue->head];
 }
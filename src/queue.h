@@ -1,29 +1,41 @@
 #ifndef queue_h
 #define queue_h
 
+#define QUEUE_LENGTH 8
+
+/**
+ * A small ring of key codes.
+ * */
+struct queue
+{
+    int store[QUEUE_LENGTH];
+    int tail;
+    int head;
+};
+
 /**
  * Clears the queue.
  * */
-void clearQueue();
+void clearQueue(struct queue* queue);
 
 /**
  * Returns the current length of the queue.
  * */
-int lengthOfQueue();
+int lengthOfQueue(struct queue* queue);
 
 /**
  * Pushes the value on the queue, if the value does not already exist in the queue.
  * */
-void enqueue(int value);
+void enqueue(struct queue* queue, int value);
 
 /**
  * Removes the first value from the queue and returns it.
  * */
-int dequeue();
+int dequeue(struct queue* queue);
 
 /**
  * Returns the first value in the queue without removing it.
  * */
-int peek();
+int peek(struct queue* queue);
 
 #endif
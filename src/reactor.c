@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "buffers.h"
+#include "reactor.h"
+
+/**
+ * The maximum number of events dispatched per wait.
+ * */
+#define REACTOR_EVENTS 16
+
+static int epoll_descriptor = -1;
+
+/**
+ * Creates the event loop.
+ * */
+int reactor_initialize()
+{
+    epoll_descriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_descriptor < 0)
+    {
+        error("error: failed to create the event loop: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Registers or updates a watcher.
+ * */
+static int control(int operation, struct watcher* watcher, uint32_t events)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = watcher;
+    if (epoll_ctl(epoll_descriptor, operation, watcher->file_descriptor, &event) < 0)
+    {
+        error("error: failed to watch file descriptor %i: %s\n", watcher->file_descriptor, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Starts watching a file descriptor.
+ *
+ * @param watcher The watcher, which must stay valid until removed.
+ * @param events The epoll events to watch for.
+ * */
+int reactor_add(struct watcher* watcher, uint32_t events)
+{
+    return control(EPOLL_CTL_ADD, watcher, events);
+}
+
+/**
+ * Changes the events watched for a file descriptor.
+ * */
+int reactor_modify(struct watcher* watcher, uint32_t events)
+{
+    return control(EPOLL_CTL_MOD, watcher, events);
+}
+
+/**
+ * Stops watching a file descriptor.
+ * */
+int reactor_remove(struct watcher* watcher)
+{
+    if (epoll_ctl(epoll_descriptor, EPOLL_CTL_DEL, watcher->file_descriptor, NULL) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Returns the epoll file descriptor, which is readable while any watcher is ready.
+ * */
+int reactor_descriptor()
+{
+    return epoll_descriptor;
+}
+
+/**
+ * Waits for watched file descriptors to become ready and dispatches them.
+ *
+ * @param timeout The timeout in milliseconds, or -1 to wait indefinitely.
+ * @return int The number of dispatched watchers, or -1 on error.
+ * */
+int reactor_wait(int timeout)
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    int count = epoll_wait(epoll_descriptor, events, REACTOR_EVENTS, timeout);
+    if (count < 0)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+        error("error: failed to wait for events: %s\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        struct watcher* watcher = events[i].data.ptr;
+        watcher->on_ready(watcher, events[i].events);
+    }
+    return count;
+}
+
+/**
+ * Releases the event loop.
+ * */
+void reactor_release()
+{
+    if (epoll_descriptor >= 0)
+    {
+        close(epoll_descriptor);
+        epoll_descriptor = -1;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef reactor_h
+#define reactor_h
+
+#include <stdint.h>
+
+/**
+ * A file descriptor watched by the event loop.
+ * */
+struct watcher
+{
+    /**
+     * The watched file descriptor.
+     * */
+    int file_descriptor;
+    /**
+     * Called when the file descriptor is ready.
+     *
+     * @param watcher The watcher.
+     * @param events The ready epoll events.
+     * */
+    void (*on_ready)(struct watcher* watcher, uint32_t events);
+};
+
+/**
+ * Creates the event loop.
+ * */
+int reactor_initialize();
+
+/**
+ * Starts watching a file descriptor.
+ *
+ * @param watcher The watcher, which must stay valid until removed.
+ * @param events The epoll events to watch for.
+ * */
+int reactor_add(struct watcher* watcher, uint32_t events);
+
+/**
+ * Changes the events watched for a file descriptor.
+ * */
+int reactor_modify(struct watcher* watcher, uint32_t events);
+
+/**
+ * Stops watching a file descriptor.
+ * */
+int reactor_remove(struct watcher* watcher);
+
+/**
+ * Returns the epoll file descriptor, which is readable while any watcher is ready.
+ * */
+int reactor_descriptor();
+
+/**
+ * Waits for watched file descriptors to become ready and dispatches them.
+ *
+ * @param timeout The timeout in milliseconds, or -1 to wait indefinitely.
+ * @return int The number of dispatched watchers, or -1 on error.
+ * */
+int reactor_wait(int timeout);
+
+/**
+ * Releases the event loop.
+ * */
+void reactor_release();
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdio.h>
+
+#include "buffers.h"
+#include "statistics.h"
+
+struct statistics statistics = { 0 };
+
+/**
+ * Returns the ratio of two counters, or zero if the divisor is zero.
+ * */
+static double ratio(unsigned long dividend, unsigned long divisor)
+{
+    if (divisor == 0)
+    {
+        return 0;
+    }
+    return (double)dividend / (double)divisor;
+}
+
+/**
+ * Logs the runtime counters.
+ * */
+void print_statistics()
+{
+    log("info: input: %lu events, %lu frames, %lu reads (%.2f events per read)\n",
+        statistics.input_events,
+        statistics.input_frames,
+        statistics.input_reads,
+        ratio(statistics.input_events, statistics.input_reads));
+    log("info: passthrough: %lu frames written as they came\n", statistics.passthrough_frames);
+    log("info: filtered input: %lu events by the kernel (estimated), %lu events after reading\n",
+        statistics.masked_events,
+        statistics.filtered_events);
+    if (statistics.input_drops > 0)
+    {
+        log("info: dropped input: %lu times the kernel dropped events and the keys were resynchronized\n",
+            statistics.input_drops);
+    }
+    if (statistics.input_disconnects > 0)
+    {
+        log("info: hotplug: %lu disconnects, %lu reconnects\n",
+            statistics.input_disconnects,
+            statistics.input_reconnects);
+    }
+    if (statistics.reloads > 0 || statistics.reloads_avoided > 0)
+    {
+        log("info: configuration: %lu reloads, %lu reloads avoided by coalescing file changes\n",
+            statistics.reloads,
+            statistics.reloads_avoided);
+    }
+    log("info: output: %lu events, %lu writes (%.2f events per write)\n",
+        statistics.output_events,
+        statistics.output_writes,
+        ratio(statistics.output_events, statistics.output_writes));
+    if (statistics.output_suppressed_events > 0)
+    {
+        log("info: output: %lu redundant key events suppressed\n", statistics.output_suppressed_events);
+    }
+    if (statistics.output_queued_events > 0 || statistics.output_dropped_events > 0)
+    {
+        log("info: output backpressure: %lu events queued, %lu events dropped, %lu overflows\n",
+            statistics.output_queued_events,
+            statistics.output_dropped_events,
+            statistics.output_overflows);
+    }
+    log("info: event loop: %lu syscalls (%.2f per input frame)\n",
+        statistics.syscalls,
+        ratio(statistics.syscalls, statistics.input_frames));
+    if (statistics.latency_frames > 0)
+    {
+        log("info: added latency: %.1f us average, %lu us maximum over %lu frames\n",
+            ratio(statistics.latency_total, statistics.latency_frames),
+            statistics.latency_maximum,
+            statistics.latency_frames);
+    }
+    if (statistics.pipeline_frames > 0)
+    {
+        log("info: pipeline: %lu frames, %.2f frames per drain, %lu frames maximum occupancy, %lu full waits, %lu reader syscalls\n",
+            statistics.pipeline_frames,
+            ratio(statistics.pipeline_occupancy_total, statistics.pipeline_drains),
+            statistics.pipeline_occupancy_maximum,
+            statistics.pipeline_full_waits,
+            statistics.pipeline_syscalls);
+        log("info: pipeline: reader stage %.1f us average, %lu us maximum over %lu frames\n",
+            ratio(statistics.pipeline_reader_latency_total, statistics.pipeline_reader_frames),
+            statistics.pipeline_reader_latency_maximum,
+            statistics.pipeline_reader_frames);
+        log("info: pipeline: ring %.1f us average, %lu us maximum, writer stage %.1f us average, %lu us maximum\n",
+            ratio(statistics.pipeline_ring_latency_total, statistics.pipeline_frames),
+            statistics.pipeline_ring_latency_maximum,
+            ratio(statistics.pipeline_writer_latency_total, statistics.pipeline_frames),
+            statistics.pipeline_writer_latency_maximum);
+    }
+    if (statistics.busy_poll_windows > 0)
+    {
+        log("info: busy polling: %lu windows, %lu polls caught events without a wake-up, %lu empty polls\n",
+            statistics.busy_poll_windows,
+            statistics.busy_poll_hits,
+            statistics.busy_poll_spins);
+    }
+}
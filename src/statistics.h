@@ -0,0 +1,169 @@
+#ifndef statistics_h
+#define statistics_h
+
+/**
+ * Runtime counters, reported on exit and on SIGUSR1.
+ * In pipeline mode the reader and writer threads update counters the event loop leaves alone
+ * while they run, the reader thread counts its syscalls in pipeline_syscalls. They update them
+ * without locking, so a report taken while they run may be slightly stale.
+ * */
+struct statistics
+{
+    /**
+     * The number of read syscalls made on the input device.
+     * */
+    unsigned long input_reads;
+    /**
+     * The number of input events received.
+     * */
+    unsigned long input_events;
+    /**
+     * The number of input frames (events terminated by SYN_REPORT) received.
+     * */
+    unsigned long input_frames;
+    /**
+     * The number of input frames written as they came, without running the mapper.
+     * */
+    unsigned long passthrough_frames;
+    /**
+     * The number of input events the kernel filtered before they were read (estimated).
+     * In the one event per read loop, each of them was a wake-up and a write.
+     * */
+    unsigned long masked_events;
+    /**
+     * The number of unsupported input events dropped after they were read.
+     * */
+    unsigned long filtered_events;
+    /**
+     * The number of times the kernel dropped input events (SYN_DROPPED) and the keys were resynchronized.
+     * */
+    unsigned long input_drops;
+    /**
+     * The number of times an input device disconnected.
+     * */
+    unsigned long input_disconnects;
+    /**
+     * The number of times an input device was captured again after it disconnected.
+     * */
+    unsigned long input_reconnects;
+    /**
+     * The number of configuration reloads.
+     * */
+    unsigned long reloads;
+    /**
+     * The number of configuration file changes folded into a reload that was already pending.
+     * */
+    unsigned long reloads_avoided;
+    /**
+     * The number of write syscalls made on the output device.
+     * */
+    unsigned long output_writes;
+    /**
+     * The number of output events written, including SYN_REPORT.
+     * */
+    unsigned long output_events;
+    /**
+     * The number of output events queued because the output device did not accept them.
+     * */
+    unsigned long output_queued_events;
+    /**
+     * The number of key events not written because they would not change the output device.
+     * */
+    unsigned long output_suppressed_events;
+    /**
+     * The number of times the output queue overflowed and every key was released.
+     * */
+    unsigned long output_overflows;
+    /**
+     * The number of output events dropped.
+     * */
+    unsigned long output_dropped_events;
+    /**
+     * The number of syscalls made by the event loop (waits, reads and writes).
+     * */
+    unsigned long syscalls;
+    /**
+     * The number of busy polling windows started.
+     * */
+    unsigned long busy_poll_windows;
+    /**
+     * The number of polls that found something ready while busy polling, each one a wake-up avoided.
+     * */
+    unsigned long busy_poll_hits;
+    /**
+     * The number of polls that found nothing ready while busy polling.
+     * */
+    unsigned long busy_poll_spins;
+    /**
+     * The number of output frames with a known input timestamp.
+     * */
+    unsigned long latency_frames;
+    /**
+     * The total latency added between the input and output frames, in microseconds.
+     * */
+    unsigned long latency_total;
+    /**
+     * The largest latency added between an input and output frame, in microseconds.
+     * */
+    unsigned long latency_maximum;
+    /**
+     * The number of frames passed from the reader thread to the writer thread.
+     * */
+    unsigned long pipeline_frames;
+    /**
+     * The number of times the writer thread drained the ring.
+     * */
+    unsigned long pipeline_drains;
+    /**
+     * The sum of the ring occupancy seen by each drain, in frames.
+     * */
+    unsigned long pipeline_occupancy_total;
+    /**
+     * The largest ring occupancy, in frames.
+     * */
+    unsigned long pipeline_occupancy_maximum;
+    /**
+     * The number of times the reader thread waited for room in the ring.
+     * */
+    unsigned long pipeline_full_waits;
+    /**
+     * The number of syscalls made by the reader thread, apart from those of the event loop.
+     * */
+    unsigned long pipeline_syscalls;
+    /**
+     * The number of frames with a known input timestamp that the reader thread pushed.
+     * */
+    unsigned long pipeline_reader_frames;
+    /**
+     * The total time from the input frame to its push to the ring, in microseconds.
+     * */
+    unsigned long pipeline_reader_latency_total;
+    /**
+     * The longest time from an input frame to its push to the ring, in microseconds.
+     * */
+    unsigned long pipeline_reader_latency_maximum;
+    /**
+     * The total time frames spent in the ring before the writer thread took them, in microseconds.
+     * */
+    unsigned long pipeline_ring_latency_total;
+    /**
+     * The longest time a frame spent in the ring before the writer thread took it, in microseconds.
+     * */
+    unsigned long pipeline_ring_latency_maximum;
+    /**
+     * The total time from taking frames from the ring to their write to the output device, in microseconds.
+     * */
+    unsigned long pipeline_writer_latency_total;
+    /**
+     * The longest time from taking frames from the ring to their write to the output device, in microseconds.
+     * */
+    unsigned long pipeline_writer_latency_maximum;
+};
+extern struct statistics statistics;
+
+/**
+ * Logs the runtime counters.
+ * */
+void print_statistics();
+
+#endif
@@ -3,13 +3,23 @@
 // run
 // ./out/test
 
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <linux/input.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "binding.h"
 #include "config.h"
+#include "engine.h"
 #include "keys.h"
+#include "keystate.h"
+#include "reactor.h"
+#include "statistics.h"
 
 // minunit http://www.jera.com/techinfo/jtns/jtn002.html
 #define mu_assert(message, test)     \
@@ -30,17 +40,63 @@ static int tests_run;
 static char output[256];
 
 // String for the emit function output
-static char emitString[8];
+static char emitString[32];
+
+// The mapper state the tests restore, so no test leaves the mapper pointing at its own stack
+static struct mapper_state test_mapper;
+
+// The key set that records pressed keys instead of emitting them, or NULL
+static unsigned char* capture = NULL;
+
+// Set while benchmarking, the emitted events are only counted
+static int benchmarking = 0;
+static unsigned long benchmark_events = 0;
 
 /*
  * Override of the emit function(s).
  */
 int emit(int type, int code, int value)
 {
+    if (capture != NULL)
+    {
+        if (type == EV_KEY && code < KEY_CNT)
+        {
+            capture[code] = value != 0;
+        }
+        return 0;
+    }
+    if (benchmarking)
+    {
+        benchmark_events++;
+        return 0;
+    }
     sprintf(emitString, "%i:%i ", code, value);
     strcat(output, emitString);
     return 0;
 }
+void emit_frame(struct input_event* events, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].type == EV_KEY)
+        {
+            emit(events[i].type, events[i].code, events[i].value);
+        }
+    }
+}
+void emit_flush()
+{
+}
+void emit_discard(int enable)
+{
+}
+void emit_source(struct input_device* device)
+{
+}
+void emit_capture(unsigned char* keys)
+{
+    capture = keys;
+}
 
 // Now include the mapper
 #include "mapper.h"
@@ -263,6 +319,311 @@ static int testSpecialTyping()
         printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
     }
 
+    // Space down, sequence down, sequence repeat, sequence up, space up
+    // Every key of the sequence should be sent for the press, repeat and release
+    description = "sd, qd, qr, qu, su";
+    expected = "29:1 46:1 29:2 46:2 29:0 46:0 29:0 46:0 ";
+    type(10, KEY_SPACE, 1, KEY_E, 1, KEY_E, 2, KEY_E, 0, KEY_SPACE, 0);
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    // Space held when the device is captured, mapped down, up, space up
+    // The held space should act as the hyper key without typing a space
+    description = "(sh), md, mu, su";
+    expected = "105:1 105:0 ";
+    seedKey(KEY_SPACE, 1, 0);
+    type(6, KEY_J, 1, KEY_J, 0, KEY_SPACE, 0);
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    return 0;
+}
+
+/*
+ * Tests for typing on two devices.
+ * Each device has its own mapper state.
+ */
+static int testDeviceTyping()
+{
+    struct mapper_state first;
+    struct mapper_state second;
+    struct key_output second_keymap[256];
+    memcpy(second_keymap, configuration->keymap, sizeof(second_keymap));
+    second_keymap[KEY_J].frames[1][0].code = KEY_HOME;
+    second_keymap[KEY_J].frames[0][0].code = KEY_HOME;
+    initializeMapper(&first, NULL);
+    initializeMapper(&second, second_keymap);
+
+    // Space down on the first device, mapped down, up on the second device, space up on the first device
+    // The second device should not see the hyper key of the first device
+    char* description = "1:sd, 2:md, 2:mu, 1:su";
+    char* expected = "36:1 36:0 57:1 57:0 ";
+    for (int i = 0; i < 256; i++) output[i] = 0;
+    mapper = &first;
+    processKey(EV_KEY, KEY_SPACE, 1);
+    mapper = &second;
+    processKey(EV_KEY, KEY_J, 1);
+    processKey(EV_KEY, KEY_J, 0);
+    mapper = &first;
+    processKey(EV_KEY, KEY_SPACE, 0);
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        mapper = &test_mapper;
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    // Space down, mapped down, up, space up on the second device, which has its own bindings
+    description = "2:sd, 2:md, 2:mu, 2:su";
+    expected = "102:1 102:0 ";
+    mapper = &second;
+    type(8, KEY_SPACE, 1, KEY_J, 1, KEY_J, 0, KEY_SPACE, 0);
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        mapper = &test_mapper;
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    mapper = &test_mapper;
+    return 0;
+}
+
+/*
+ * Tests for loading and swapping a configuration.
+ * A failed load keeps the running configuration.
+ */
+static int testConfigurationSwap()
+{
+    char path[] = "/tmp/touchcursor-test-XXXXXX";
+    int file = mkstemp(path);
+    if (file < 0) return 1;
+    char* text = "[Hyper]\nHyper=KEY_SPACE\n[Bindings]\nKEY_J=KEY_HOME\n";
+    write(file, text, strlen(text));
+    close(file);
+    strcpy(configuration_file_path, path);
+    struct configuration* loaded = load_configuration();
+    unlink(path);
+    if (loaded == NULL) return 1;
+    struct configuration* previous = activate_configuration(loaded);
+    struct mapper_state state;
+    initializeMapper(&state, NULL);
+    mapper = &state;
+
+    // Space down, mapped down, up, space up with the loaded bindings
+    char* description = "swapped: sd, md, mu, su";
+    char* expected = "102:1 102:0 ";
+    type(8, KEY_SPACE, 1, KEY_J, 1, KEY_J, 0, KEY_SPACE, 0);
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        mapper = &test_mapper;
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    // The configuration file is gone, the loaded configuration stays active
+    description = "failed load: sd, md, mu, su";
+    if (load_configuration() != NULL)
+    {
+        mapper = &test_mapper;
+        return 1;
+    }
+    type(8, KEY_SPACE, 1, KEY_J, 1, KEY_J, 0, KEY_SPACE, 0);
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        mapper = &test_mapper;
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    free_configuration(activate_configuration(previous));
+    mapper = &test_mapper;
+    return 0;
+}
+
+/*
+ * Tests for the output key state.
+ * Redundant events are rejected and held keys are iterated in order.
+ */
+static int testKeyState()
+{
+    // Press, press again, repeat, release, release again
+    char* description = "kd, kd, kr, ku, ku";
+    char* expected = "1 0 1 1 0 ";
+    for (int i = 0; i < 256; i++) output[i] = 0;
+    int updates[] = { 1, 1, 2, 0, 0 };
+    for (int i = 0; i < 5; i++)
+    {
+        sprintf(emitString, "%i ", keystate_update(KEY_K, updates[i]));
+        strcat(output, emitString);
+    }
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    // Held keys across words are found in order
+    description = "held: 700, 1, 64, 63";
+    expected = "1 63 64 700 ";
+    for (int i = 0; i < 256; i++) output[i] = 0;
+    keystate_update(700, 1);
+    keystate_update(1, 1);
+    keystate_update(64, 1);
+    keystate_update(63, 1);
+    for (int code = keystate_next(0); code >= 0; code = keystate_next(code + 1))
+    {
+        snprintf(emitString, sizeof(emitString), "%i ", code);
+        strcat(output, emitString);
+    }
+    if (strcmp(expected, output) != 0 || keystate_count() != 4)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+
+    keystate_clear();
+    if (keystate_next(0) != -1) return 1;
+    return 0;
+}
+
+/*
+ * Tests for forwarding the LEDs of the output device.
+ * The last state of each LED is written to a keyboard as one frame, a failed write is flagged.
+ */
+static int testLedForwarding()
+{
+    int output_pipe[2];
+    int keyboard_pipe[2];
+    if (pipe2(output_pipe, O_CLOEXEC | O_NONBLOCK) < 0) return 1;
+    if (pipe2(keyboard_pipe, O_CLOEXEC | O_NONBLOCK) < 0) return 1;
+    int saved_output = output_file_descriptor;
+    int saved_count = input_device_count;
+    struct input_device saved_devices[2];
+    memcpy(saved_devices, input_devices, sizeof(saved_devices));
+    memset(input_devices, 0, sizeof(saved_devices));
+    output_file_descriptor = output_pipe[0];
+    input_device_count = 2;
+    input_devices[0].file_descriptor = keyboard_pipe[1];
+    input_devices[0].has_leds = 1;
+    // The read end cannot be written, like a keyboard opened read only
+    input_devices[1].file_descriptor = keyboard_pipe[0];
+    input_devices[1].has_leds = 1;
+
+    // Caps lock on, num lock on, caps lock off
+    char* description = "capsl on, numl on, capsl off";
+    char* expected = "17:0:1 17:1:0 0:0:0 ";
+    struct input_event changes[3] = {
+        { .type = EV_LED, .code = LED_CAPSL, .value = 1 },
+        { .type = EV_LED, .code = LED_NUML, .value = 1 },
+        { .type = EV_LED, .code = LED_CAPSL, .value = 0 }
+    };
+    struct input_event written[8];
+    ssize_t length = -1;
+    if (write(output_pipe[1], changes, sizeof(changes)) == sizeof(changes))
+    {
+        forward_output_leds();
+        length = read(keyboard_pipe[0], written, sizeof(written));
+    }
+    for (int i = 0; i < 256; i++) output[i] = 0;
+    for (ssize_t i = 0; i < length / (ssize_t)sizeof(struct input_event); i++)
+    {
+        snprintf(emitString, sizeof(emitString), "%i:%i:%i ", written[i].type, written[i].code, written[i].value);
+        strcat(output, emitString);
+    }
+    int flagged = !input_devices[0].led_write_failed && input_devices[1].led_write_failed;
+
+    output_file_descriptor = saved_output;
+    input_device_count = saved_count;
+    memcpy(input_devices, saved_devices, sizeof(saved_devices));
+    close(output_pipe[0]);
+    close(output_pipe[1]);
+    close(keyboard_pipe[0]);
+    close(keyboard_pipe[1]);
+    if (strcmp(expected, output) != 0 || !flagged)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
+    return 0;
+}
+
+/*
+ * Tests for reconciling the held keys of a device with its bindings, as on a reload or after dropped events.
+ * Keys bound to a held hyper key stay mapped.
+ */
+static int testReconcile()
+{
+    static struct input_device device;
+    memset(&device, 0, sizeof(device));
+    initializeMapper(&device.mapper, NULL);
+    const int bits = 8 * sizeof(long);
+    device.grab_keys[KEY_SPACE / bits] |= 1UL << (KEY_SPACE % bits);
+    device.grab_keys[KEY_J / bits] |= 1UL << (KEY_J % bits);
+    // Space and J are held, the output device holds the mapped key
+    device.held[KEY_LEFT] = 1;
+
+    // (Space and mapped held), reconcile, mapped repeat, up, space up
+    // Nothing is released by the reconcile, the second release is dropped by the output key state
+    char* description = "(sh, mh), reconcile, mr, mu, su";
+    char* expected = "105:2 105:0 105:0 ";
+    for (int i = 0; i < 256; i++) output[i] = 0;
+    reconcile_held_keys(&device);
+    processKey(EV_KEY, KEY_J, 2);
+    processKey(EV_KEY, KEY_J, 0);
+    processKey(EV_KEY, KEY_SPACE, 0);
+    mapper = &test_mapper;
+    if (strcmp(expected, output) != 0)
+    {
+        printf("[%s] failed. expected: '%s', output: '%s'\n", description, expected, output);
+        return 1;
+    }
+    else
+    {
+        printf("[%s] passed. expected: '%s', output: '%s'\n", description, expected, output);
+    }
     return 0;
 }
 
@@ -272,18 +633,23 @@ static int testSpecialTyping()
 static int runTests()
 {
     // default config
-    hyperKey = KEY_SPACE;
-    keymap[KEY_I].sequence[0] = KEY_UP;
-    keymap[KEY_J].sequence[0] = KEY_LEFT;
-    keymap[KEY_K].sequence[0] = KEY_DOWN;
-    keymap[KEY_L].sequence[0] = KEY_RIGHT;
-    keymap[KEY_H].sequence[0] = KEY_PAGEUP;
-    keymap[KEY_N].sequence[0] = KEY_PAGEDOWN;
-    keymap[KEY_U].sequence[0] = KEY_HOME;
-    keymap[KEY_O].sequence[0] = KEY_END;
-    keymap[KEY_M].sequence[0] = KEY_DELETE;
-    keymap[KEY_P].sequence[0] = KEY_BACKSPACE;
-    keymap[KEY_Y].sequence[0] = KEY_INSERT;
+    configuration->hyperKey = KEY_SPACE;
+    configuration->keymap[KEY_I].sequence[0] = KEY_UP;
+    configuration->keymap[KEY_J].sequence[0] = KEY_LEFT;
+    configuration->keymap[KEY_K].sequence[0] = KEY_DOWN;
+    configuration->keymap[KEY_L].sequence[0] = KEY_RIGHT;
+    configuration->keymap[KEY_H].sequence[0] = KEY_PAGEUP;
+    configuration->keymap[KEY_N].sequence[0] = KEY_PAGEDOWN;
+    configuration->keymap[KEY_U].sequence[0] = KEY_HOME;
+    configuration->keymap[KEY_O].sequence[0] = KEY_END;
+    configuration->keymap[KEY_M].sequence[0] = KEY_DELETE;
+    configuration->keymap[KEY_P].sequence[0] = KEY_BACKSPACE;
+    configuration->keymap[KEY_Y].sequence[0] = KEY_INSERT;
+    configuration->keymap[KEY_E].sequence[0] = KEY_LEFTCTRL;
+    configuration->keymap[KEY_E].sequence[1] = KEY_C;
+    compile_bindings(configuration);
+    initializeMapper(&test_mapper, NULL);
+    mapper = &test_mapper;
 
     mu_run_test(testNormalTyping);
     printf("Normal typing tests passed.\n");
@@ -294,9 +660,142 @@ static int runTests()
     mu_run_test(testSpecialTyping);
     printf("Special typing tests passed.\n");
 
+    mu_run_test(testDeviceTyping);
+    printf("Device typing tests passed.\n");
+
+    mu_run_test(testConfigurationSwap);
+    printf("Configuration swap tests passed.\n");
+
+    mu_run_test(testKeyState);
+    printf("Key state tests passed.\n");
+
+    mu_run_test(testLedForwarding);
+    printf("LED forwarding tests passed.\n");
+
+    mu_run_test(testReconcile);
+    printf("Reconcile tests passed.\n");
+
     return 0;
 }
 
+// Benchmark state
+static int benchmark_output;
+static struct input_event benchmark_buffer[64];
+
+/*
+ * Returns the benchmark read buffer.
+ */
+static void* benchmarkBuffer(struct reader* reader, size_t* length)
+{
+    *length = sizeof(benchmark_buffer);
+    return benchmark_buffer;
+}
+
+/*
+ * Forwards every read to the output, like the main loop does for an unmapped key.
+ */
+static void benchmarkRead(struct reader* reader, ssize_t result)
+{
+    if (result > 0)
+    {
+        engine_write(benchmark_output, benchmark_buffer, result);
+    }
+}
+
+/*
+ * Counts the event loop syscalls per keystroke for an engine.
+ * Each keystroke is written to a pipe and handled by one wait, as a typist would produce it.
+ */
+static void benchmarkEngine(enum engines requested, char* name)
+{
+    const int keystrokes = 1000;
+    int input[2];
+    if (pipe2(input, O_CLOEXEC) < 0) return;
+    benchmark_output = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    reactor_initialize();
+    engine_initialize(requested);
+    if (engine != requested)
+    {
+        printf("[%s engine] skipped, the engine is unavailable.\n", name);
+    }
+    else
+    {
+        struct reader reader = { { input[0], NULL }, benchmarkBuffer, benchmarkRead };
+        engine_start_reader(&reader);
+        struct input_event keystroke[2] = {
+            { .type = EV_KEY, .code = KEY_A, .value = 1 },
+            { .type = EV_SYN, .code = SYN_REPORT, .value = 0 }
+        };
+        statistics.syscalls = 0;
+        for (int i = 0; i < keystrokes; i++)
+        {
+            if (write(input[1], keystroke, sizeof(keystroke)) < 0) break;
+            engine_wait(-1);
+        }
+        unsigned long syscalls = statistics.syscalls;
+        engine_stop_reader(&reader);
+        printf("[%s engine] %.2f syscalls per keystroke\n", name, (double)syscalls / keystrokes);
+    }
+    engine_release();
+    reactor_release();
+    close(benchmark_output);
+    close(input[0]);
+    close(input[1]);
+}
+
+/*
+ * Returns the mapper time per event for a key typed in the idle state, in nanoseconds.
+ */
+static double measureIdleKey(int code, int events)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < events; i++)
+    {
+        processKey(EV_KEY, code, !(i & 1));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / events;
+}
+
+/*
+ * Compares the mapper time per event for idle keys through the state machine and through the action table.
+ * The state machine is measured by marking the key remapped, it is remapped to nothing so its output is the same.
+ */
+static void benchmarkIdleKeys()
+{
+    const int events = 1000000;
+    struct mapper_state state;
+    initializeMapper(&state, NULL);
+    mapper = &state;
+    benchmarking = 1;
+    benchmark_events = 0;
+    configuration->key_actions[KEY_A] = key_action_remap;
+    double generic = measureIdleKey(KEY_A, events);
+    configuration->key_actions[KEY_A] = key_action_pass;
+    double fast = measureIdleKey(KEY_A, events);
+    benchmarking = 0;
+    if (benchmark_events != 2UL * events)
+    {
+        printf("[idle keys] failed, %lu events emitted for %i\n", benchmark_events, 2 * events);
+    }
+    else
+    {
+        printf("[idle keys] %.1f ns/event through the state machine, %.1f ns/event through the action table\n", generic, fast);
+    }
+    mapper = &test_mapper;
+}
+
+/*
+ * Simple method for running all benchmarks.
+ */
+static void runBenchmarks()
+{
+    benchmarkIdleKeys();
+    benchmarkEngine(engine_syscall, "syscall");
+    benchmarkEngine(engine_io_uring, "io_uring");
+}
+
 /*
  * Main method.
  */
@@ -312,6 +811,7 @@ int main()
         printf("All tests passed!\n");
     }
     printf("Tests run: %d\n", tests_run);
+    runBenchmarks();
 }
 
 // Sample tests from touchcursor source
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "binding.h"
+#include "buffers.h"
+#include "config.h"
+#include "keystate.h"
+#include "mapper.h"
+#include "upgrade.h"
+
+/**
+ * Identifies a state snapshot ("TCU1").
+ * */
+#define SNAPSHOT_MAGIC 0x31554354
+
+/**
+ * The start of a state snapshot, which names the handed over descriptors.
+ * It keeps its layout across versions, so a process that cannot read the rest of
+ * the snapshot can still release the devices.
+ * */
+struct snapshot_header
+{
+    unsigned int magic;
+    // The size of the whole snapshot, which differs between incompatible versions
+    unsigned int size;
+    int output_file_descriptor;
+    int device_count;
+    int file_descriptors[MAX_INPUT_DEVICES];
+};
+
+/**
+ * The state of a captured input device.
+ * */
+struct device_snapshot
+{
+    char configuration[256];
+    char event_path[256];
+    char name[256];
+    int clock;
+    int scancodes_masked;
+    int has_leds;
+    enum states state;
+    int hyperEmitted;
+    struct queue queue;
+    unsigned char held[KEY_CNT];
+    // The partial frame read before the upgrade
+    struct input_event buffer[INPUT_BUFFER_EVENTS];
+    size_t buffer_bytes;
+};
+
+/**
+ * The state handed over to the new process.
+ * */
+struct snapshot
+{
+    struct snapshot_header header;
+    unsigned long output_keys[KEY_BITMAP_SIZE / sizeof(long)];
+    unsigned long output_relatives[REL_BITMAP_SIZE / sizeof(long)];
+    // The keys held on the output device
+    unsigned char output_keys_down[KEY_CNT];
+    unsigned char output_key_references[KEY_CNT];
+    struct device_snapshot devices[MAX_INPUT_DEVICES];
+};
+
+/**
+ * Sets or clears the close-on-exec flag of a descriptor.
+ * */
+static int set_close_on_exec(int file_descriptor, int enable)
+{
+    return fcntl(file_descriptor, F_SETFD, enable ? FD_CLOEXEC : 0);
+}
+
+/**
+ * Releases the handed over devices, for a snapshot that cannot be resumed.
+ * */
+static void release_handed_descriptors(const struct snapshot_header* header)
+{
+    for (int i = 0; i < header->device_count && i < MAX_INPUT_DEVICES; i++)
+    {
+        ioctl(header->file_descriptors[i], EVIOCGRAB, 0);
+        close(header->file_descriptors[i]);
+    }
+    if (header->output_file_descriptor >= 0)
+    {
+        close(header->output_file_descriptor);
+    }
+}
+
+/**
+ * Replaces the process with a new executable, handing over the devices and the mapper state.
+ *
+ * @return int EXIT_FAILURE if the executable could not be run, the process then keeps its devices.
+ * */
+int upgrade(const char* executable)
+{
+    struct snapshot* snapshot = calloc(1, sizeof(struct snapshot));
+    if (snapshot == NULL)
+    {
+        error("error: failed to allocate the state snapshot\n");
+        return EXIT_FAILURE;
+    }
+    snapshot->header.magic = SNAPSHOT_MAGIC;
+    snapshot->header.size = sizeof(struct snapshot);
+    snapshot->header.output_file_descriptor = output_file_descriptor;
+    get_output_capabilities(snapshot->output_keys, snapshot->output_relatives);
+    for (int code = keystate_next(0); code >= 0; code = keystate_next(code + 1))
+    {
+        snapshot->output_keys_down[code] = 1;
+    }
+    memcpy(snapshot->output_key_references, output_key_references, sizeof(output_key_references));
+    for (int i = 0; i < input_device_count; i++)
+    {
+        struct input_device* device = &input_devices[i];
+        // A device waiting for its keys to be released is opened again by the new process
+        if (device->file_descriptor < 0 || !device->grabbed)
+        {
+            continue;
+        }
+        struct device_snapshot* saved = &snapshot->devices[snapshot->header.device_count];
+        snapshot->header.file_descriptors[snapshot->header.device_count++] = device->file_descriptor;
+        strcpy(saved->configuration, device->selection.configuration);
+        strcpy(saved->event_path, device->selection.event_path);
+        strcpy(saved->name, device->name);
+        saved->clock = device->clock;
+        saved->scancodes_masked = device->scancodes_masked;
+        saved->has_leds = device->has_leds;
+        saved->state = device->mapper.state;
+        saved->hyperEmitted = device->mapper.hyperEmitted;
+        saved->queue = device->mapper.queue;
+        memcpy(saved->held, device->held, sizeof(saved->held));
+        memcpy(saved->buffer, device->buffer, device->buffer_bytes);
+        saved->buffer_bytes = device->buffer_bytes;
+    }
+    // The snapshot descriptor is inherited, the new process closes it once read
+    int state_descriptor = memfd_create("touchcursor-state", 0);
+    if (state_descriptor < 0
+        || write(state_descriptor, snapshot, sizeof(struct snapshot)) != sizeof(struct snapshot))
+    {
+        error("error: failed to write the state snapshot: %s\n", strerror(errno));
+        if (state_descriptor >= 0)
+        {
+            close(state_descriptor);
+        }
+        free(snapshot);
+        return EXIT_FAILURE;
+    }
+    set_close_on_exec(output_file_descriptor, 0);
+    for (int i = 0; i < snapshot->header.device_count; i++)
+    {
+        set_close_on_exec(snapshot->header.file_descriptors[i], 0);
+    }
+    char descriptor[16];
+    snprintf(descriptor, sizeof(descriptor), "%i", state_descriptor);
+    char* arguments[] = { (char*)executable, "--resume", descriptor, NULL };
+    log("info: upgrading to %s with %i input devices\n", executable, snapshot->header.device_count);
+    execv(executable, arguments);
+    error("error: failed to run %s: %s\n", executable, strerror(errno));
+    set_close_on_exec(output_file_descriptor, 1);
+    for (int i = 0; i < snapshot->header.device_count; i++)
+    {
+        set_close_on_exec(snapshot->header.file_descriptors[i], 1);
+    }
+    close(state_descriptor);
+    free(snapshot);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Takes over the devices and the mapper state handed over by a previous process.
+ * */
+int resume(int state_descriptor)
+{
+    struct snapshot* snapshot = calloc(1, sizeof(struct snapshot));
+    if (snapshot == NULL)
+    {
+        error("error: failed to allocate the state snapshot\n");
+        close(state_descriptor);
+        return EXIT_FAILURE;
+    }
+    ssize_t length = pread(state_descriptor, snapshot, sizeof(struct snapshot), 0);
+    close(state_descriptor);
+    if (length < (ssize_t)sizeof(struct snapshot_header) || snapshot->header.magic != SNAPSHOT_MAGIC)
+    {
+        error("error: the state snapshot could not be read\n");
+        free(snapshot);
+        return EXIT_FAILURE;
+    }
+    if (length != sizeof(struct snapshot) || snapshot->header.size != sizeof(struct snapshot))
+    {
+        error("error: the state snapshot is from an incompatible version, releasing the devices\n");
+        release_handed_descriptors(&snapshot->header);
+        free(snapshot);
+        return EXIT_FAILURE;
+    }
+    set_close_on_exec(snapshot->header.output_file_descriptor, 1);
+    if (resume_output(snapshot->header.output_file_descriptor, snapshot->output_keys, snapshot->output_relatives) != EXIT_SUCCESS)
+    {
+        output_file_descriptor = -1;
+        release_handed_descriptors(&snapshot->header);
+        free(snapshot);
+        return EXIT_FAILURE;
+    }
+    keystate_clear();
+    for (int code = 0; code < KEY_CNT; code++)
+    {
+        if (snapshot->output_keys_down[code])
+        {
+            keystate_update(code, 1);
+        }
+    }
+    memcpy(output_key_references, snapshot->output_key_references, sizeof(output_key_references));
+    for (int i = 0; i < snapshot->header.device_count; i++)
+    {
+        struct device_snapshot* saved = &snapshot->devices[i];
+        int file_descriptor = snapshot->header.file_descriptors[i];
+        set_close_on_exec(file_descriptor, 1);
+        // A device the configuration no longer selects keeps its own slot until its keys are released
+        struct device_selection selection = { { 0 }, { 0 }, NULL };
+        for (int j = 0; j < configuration->device_selection_count; j++)
+        {
+            if (strcmp(configuration->device_selections[j].configuration, saved->configuration) == 0)
+            {
+                selection = configuration->device_selections[j];
+            }
+        }
+        int selected = selection.configuration[0] != '\0';
+        if (!selected)
+        {
+            strcpy(selection.configuration, saved->configuration);
+        }
+        strcpy(selection.event_path, saved->event_path);
+        struct input_device* device = adopt_device_selection(&selection);
+        if (device == NULL)
+        {
+            ioctl(file_descriptor, EVIOCGRAB, 0);
+            close(file_descriptor);
+            continue;
+        }
+        device->file_descriptor = file_descriptor;
+        device->grabbed = 1;
+        strcpy(device->name, saved->name);
+        device->clock = saved->clock;
+        device->scancodes_masked = saved->scancodes_masked;
+        device->has_leds = saved->has_leds;
+        device->mapper.state = saved->state;
+        device->mapper.hyperEmitted = saved->hyperEmitted;
+        device->mapper.queue = saved->queue;
+        memcpy(device->held, saved->held, sizeof(device->held));
+        if (saved->buffer_bytes <= sizeof(device->buffer))
+        {
+            memcpy(device->buffer, saved->buffer, saved->buffer_bytes);
+            device->buffer_bytes = saved->buffer_bytes;
+        }
+        log("info: resumed: %s (%s)\n", device->name, device->selection.event_path);
+        if (!selected)
+        {
+            release_device_keys(device);
+            release_input(device);
+            drop_input_device(device);
+        }
+    }
+    free(snapshot);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,23 @@
+#ifndef upgrade_h
+#define upgrade_h
+
+/**
+ * Replaces the process with a new executable, handing over the captured input devices,
+ * the output device and the mapper state, so the devices are neither released nor recreated.
+ * The readers must be stopped, so no input event is read by the old process after the snapshot.
+ *
+ * @param executable The executable to run, started with --resume and the state descriptor.
+ * @return int EXIT_FAILURE if the executable could not be run, the process then keeps its devices.
+ * */
+int upgrade(const char* executable);
+
+/**
+ * Takes over the devices and the mapper state handed over by a previous process.
+ * The configuration must be active: the input devices it no longer selects are released.
+ * On failure every handed over device is released, so the process can start from scratch.
+ *
+ * @param state_descriptor The descriptor of the state snapshot, closed when done.
+ * */
+int resume(int state_descriptor);
+
+#endif